@@ -0,0 +1,85 @@
+#ifndef DTEXT_ASCII_H
+#define DTEXT_ASCII_H
+
+#include <string_view>
+
+// Locale-independent character classes and the normalizations used for tag names, anchors, header IDs and emoji names.
+// Bytes outside ASCII are never letters or digits. The string functions write to a buffer provided by the caller, which
+// must have room for as many bytes as the input, and return the end of what they wrote. They're written as loops without
+// branches, which the compiler can vectorize.
+namespace DText::ASCII {
+
+constexpr bool is_digit(unsigned char c) {
+  return static_cast<unsigned>(c - '0') < 10u;
+}
+
+constexpr bool is_alpha(unsigned char c) {
+  return static_cast<unsigned>((c | 0x20) - 'a') < 26u;
+}
+
+constexpr bool is_alnum(unsigned char c) {
+  return is_digit(c) || is_alpha(c);
+}
+
+constexpr unsigned char to_lower(unsigned char c) {
+  return c + 0x20 * (static_cast<unsigned>(c - 'A') < 26u);
+}
+
+// Compare two strings, ignoring the case of ASCII letters.
+constexpr bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.size(); i++) {
+    if (to_lower(a[i]) != to_lower(b[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// True if the string is only digits (or empty).
+constexpr bool is_digits(std::string_view string) {
+  bool digits = true;
+
+  for (unsigned char c : string) {
+    digits &= is_digit(c);
+  }
+
+  return digits;
+}
+
+// "Touhou" -> "touhou"
+inline char* to_lower(std::string_view input, char* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    output[i] = to_lower(input[i]);
+  }
+
+  return output + input.size();
+}
+
+// Tag names: "Kantai Collection" -> "kantai_collection"
+inline char* normalize_tag(std::string_view input, char* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    unsigned char c = input[i];
+    output[i] = c == ' ' ? '_' : to_lower(c);
+  }
+
+  return output + input.size();
+}
+
+// Anchors and header IDs: "See also" -> "see-also"
+inline char* normalize_anchor(std::string_view input, char* output) {
+  for (size_t i = 0; i < input.size(); i++) {
+    unsigned char c = input[i];
+    output[i] = is_alnum(c) ? to_lower(c) : '-';
+  }
+
+  return output + input.size();
+}
+
+}
+
+#endif
@@ -1,10 +1,21 @@
 #include "dtext.h"
+#include "ascii.h"
+#include "simd.h"
 #include "url.h"
 
 #include <algorithm>
+#include <bit>
+#include <cstring>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <system_error>
 #include <unordered_map>
 #include <unordered_set>
-#include <regex>
+#include <thread>
+#include <utility>
 
 #ifdef DEBUG
 #undef g_debug
@@ -18,11 +29,208 @@
 
 static const size_t MAX_STACK_DEPTH = 512;
 
+// How far a token has to scan ahead before its lookahead path is recorded for memoization, and how often the path is
+// sampled after that (see `scan_key`).
+static const ptrdiff_t MIN_MEMOIZED_LOOKAHEAD = 32;
+static const ptrdiff_t MEMOIZED_LOOKAHEAD_STRIDE = 16;
+
+// How much output is collected before it's checked against `max_output_size` and added to the output digest (see
+// `flush_output`).
+static const size_t OUTPUT_CHUNK_SIZE = 4096;
+
+// The smallest part of a document worth parsing on its own thread (see `parse_parallel`).
+static const size_t MIN_PARALLEL_PART_SIZE = 16 * 1024;
+
+// Thrown by the scanner when it reaches the end of its part of the document (see `scan_until`).
+struct SplitPoint {};
+
+// Thrown at the start of a token when it can't be matched until the next chunk of a stream is fed (see `scan`).
+struct MoreInputNeeded {};
+
+// Blocks shorter than this aren't worth adding to the block cache (see `reuse_cached_block`).
+static const size_t MIN_CACHED_BLOCK_SIZE = 64;
+
+// How many bytes of DText and HTML the block cache holds by default before it starts dropping the least recently used
+// blocks (see `StateMachine::set_block_cache_size`).
+static const size_t BLOCK_CACHE_SIZE = 16 * 1024 * 1024;
+
+// How many sets of options the block cache keeps numbers for before it starts over (see `BlockCache::options_id`).
+static const size_t MAX_BLOCK_CACHE_OPTIONS = 1024;
+
+// A process-wide cache of rendered top-level blocks, shared by every parse with `f_block_cache` set. Blocks are found
+// by a hash of their first paragraph and the options they were rendered with, since where a block ends isn't known until
+// it has been parsed. The options and the full text of a block are compared on lookup, so neither blocks that start the
+// same way nor hash collisions can return the wrong HTML.
+class BlockCache {
+public:
+  struct Block {
+    uint64_t key;
+    uint64_t options; // See `options_id`.
+    std::string input;
+    std::string html;
+    std::vector<std::string> wiki_pages;
+  };
+
+  static uint64_t key(uint64_t options, const std::string_view paragraph) {
+    return std::hash<std::string_view>{}(paragraph) ^ (options * 0x9E3779B97F4A7C15ULL);
+  }
+
+  // Return a number for a set of options (see `StateMachine::options_fingerprint`). Equal options get the same number
+  // and numbers are never reused, so blocks rendered with other options never match. If too many sets of options have
+  // been seen, the old ones get new numbers, and their blocks age out of the cache.
+  uint64_t options_id(const std::string& fingerprint) {
+    std::lock_guard lock(mutex);
+
+    if (options_ids.size() >= MAX_BLOCK_CACHE_OPTIONS && !options_ids.contains(fingerprint)) {
+      options_ids.clear();
+    }
+
+    auto [it, inserted] = options_ids.try_emplace(fingerprint, next_options_id);
+    next_options_id += inserted;
+    return it->second;
+  }
+
+  // Find a block rendered with the given options at the start of `text`, or return NULL if it isn't cached.
+  std::shared_ptr<const Block> lookup(uint64_t key, uint64_t options, const std::string_view text) {
+    std::lock_guard lock(mutex);
+
+    auto [first, last] = index.equal_range(key);
+    for (auto it = first; it != last; it++) {
+      auto block = it->second;
+
+      if ((*block)->options == options && text.starts_with((*block)->input)) {
+        blocks.splice(blocks.begin(), blocks, block);
+        return *block;
+      }
+    }
+
+    return NULL;
+  }
+
+  void insert(Block block) {
+    std::lock_guard lock(mutex);
+
+    auto [first, last] = index.equal_range(block.key);
+    for (auto it = first; it != last; it++) {
+      if ((*it->second)->options == block.options && (*it->second)->input == block.input) {
+        return;
+      }
+    }
+
+    size += block.input.size() + block.html.size();
+    blocks.push_front(std::make_shared<const Block>(std::move(block)));
+    index.emplace(blocks.front()->key, blocks.begin());
+    evict();
+  }
+
+  void clear() {
+    std::lock_guard lock(mutex);
+
+    blocks.clear();
+    index.clear();
+    size = 0;
+  }
+
+  size_t capacity() {
+    std::lock_guard lock(mutex);
+    return max_size;
+  }
+
+  void set_capacity(size_t capacity) {
+    std::lock_guard lock(mutex);
+
+    max_size = capacity;
+    evict();
+  }
+
+private:
+  // Drop the least recently used blocks until the cache fits in `max_size`.
+  void evict() {
+    while (size > max_size) {
+      auto oldest = std::prev(blocks.end());
+      auto [first, last] = index.equal_range((*oldest)->key);
+      index.erase(std::find_if(first, last, [&](auto& entry) { return entry.second == oldest; }));
+      size -= (*oldest)->input.size() + (*oldest)->html.size();
+      blocks.pop_back();
+    }
+  }
+
+  std::mutex mutex;
+  std::list<std::shared_ptr<const Block>> blocks; // Most recently used first.
+  std::unordered_multimap<uint64_t, std::list<std::shared_ptr<const Block>>::iterator> index;
+  std::unordered_map<std::string, uint64_t> options_ids;
+  uint64_t next_options_id = 1;
+  size_t size = 0;
+  size_t max_size = BLOCK_CACHE_SIZE;
+};
+
+static BlockCache block_cache;
+
+// The bytes that can start a token other than plain text in the inline scanner, or that need to be escaped (see
+// `skip_plain_text`).
+static constexpr DText::SIMD::ByteSet structural_chars(std::string_view("\0\n\r\"#&:<>@[]{}", 14));
+
+// The bytes that end a run of text that's escaped as is in [code] and [nodtext] (see `skip_escaped_text`).
+static constexpr DText::SIMD::ByteSet verbatim_stop_chars(std::string_view("\n[<\0", 4));
+
+// The bytes that end a run of text that's escaped as is in the basic inline scanner.
+static constexpr DText::SIMD::ByteSet basic_inline_stop_chars(std::string_view("[<\0", 3));
+
+static constexpr DText::SIMD::ByteSet html_special_chars("<>&\"");
+
+// The bytes that need a closer look when checking and normalizing the input (see `append_input`).
+static constexpr DText::SIMD::ByteSet input_special_chars(std::string_view("\r\0", 2), true);
+static constexpr DText::SIMD::ByteSet carriage_return("\r");
+
+// The characters that aren't percent-encoded in URLs (RFC 3986 unreserved characters).
+static constexpr auto uri_unreserved_table = [] {
+  std::array<bool, 256> table = {};
+  for (int c = 0; c < 256; c++) {
+    table[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c == '~';
+  }
+  return table;
+}();
+
+// The percent-encoded form of each byte (`%E6`).
+static constexpr auto uri_escapes = [] {
+  constexpr char hex[] = "0123456789ABCDEF";
+  std::array<std::array<char, 3>, 256> table = {};
+  for (int c = 0; c < 256; c++) {
+    table[c] = { '%', hex[c >> 4], hex[c & 0x0F] };
+  }
+  return table;
+}();
+
 // Strip qualifier from tag: "Artoria Pendragon (Lancer) (Fate)" -> "Artoria Pendragon (Lancer)"
-static const std::regex tag_qualifier_regex("[ _]\\([^)]+?\\)$");
+//
+// Equivalent to removing /[ _]\([^)]+?\)$/. The qualifier can't contain a `)`, so we only have to walk back from the
+// final `)` to the one before it, and the qualifier starts at the leftmost " (" or "_(" in between.
+static std::string_view strip_tag_qualifier(std::string_view tag) {
+  size_t length = tag.size();
+
+  if (tag.size() < 4 || tag.back() != ')') {
+    return tag;
+  }
+
+  for (size_t i = tag.size() - 2; i > 0 && tag[i] != ')'; i--) {
+    if (tag[i] == '(' && (tag[i - 1] == ' ' || tag[i - 1] == '_') && i < tag.size() - 2) {
+      length = i - 1;
+    }
+  }
+
+  return tag.substr(0, length);
+}
+
+// The tables below are constant-initialized, so they cost nothing at load time and live in read-only pages that are
+// shared between forked processes.
 
 // Permitted HTML attribute names.
-static const std::unordered_map<std::string_view, const std::unordered_set<std::string_view>> permitted_attribute_names = {
+struct PermittedAttributeNames {
+  std::string_view tag_name;
+  std::array<std::string_view, 3> names;
+};
+
+static constexpr PermittedAttributeNames permitted_attribute_names[] = {
   { "thead",    { "align" } },
   { "tbody",    { "align" } },
   { "tr",       { "align" } },
@@ -34,17 +242,438 @@ static const std::unordered_map<std::string_view, const std::unordered_set<std::
 };
 
 // Permitted HTML attribute values.
-static const std::unordered_set<std::string_view> align_values = { "left", "center", "right", "justify" };
-static const std::unordered_set<std::string_view> target_values = { "_blank" };
-static const std::unordered_map<std::string_view, std::function<bool(std::string_view)>> permitted_attribute_values = {
-  { "align",   [](auto value) { return align_values.find(value) != align_values.end(); } },
-  { "span",    [](auto value) { return std::all_of(value.begin(), value.end(), isdigit); } },
-  { "colspan", [](auto value) { return std::all_of(value.begin(), value.end(), isdigit); } },
-  { "rowspan", [](auto value) { return std::all_of(value.begin(), value.end(), isdigit); } },
-  { "target",  [](auto value) { return target_values.find(value) != target_values.end(); } },
+static constexpr std::string_view align_values[] = { "left", "center", "right", "justify" };
+static constexpr std::string_view target_values[] = { "_blank" };
+
+static bool is_align_value(std::string_view value) {
+  return std::find(std::begin(align_values), std::end(align_values), value) != std::end(align_values);
+}
+
+static bool is_number_value(std::string_view value) {
+  return DText::ASCII::is_digits(value);
+}
+
+static bool is_target_value(std::string_view value) {
+  return std::find(std::begin(target_values), std::end(target_values), value) != std::end(target_values);
+}
+
+struct PermittedAttributeValues {
+  std::string_view name;
+  bool (*validate)(std::string_view value);
+};
+
+static constexpr PermittedAttributeValues permitted_attribute_values[] = {
+  { "align",   is_align_value },
+  { "span",    is_number_value },
+  { "colspan", is_number_value },
+  { "rowspan", is_number_value },
+  { "target",  is_target_value },
+};
+
+// True if `name="value"` is allowed on the given tag.
+static bool is_permitted_attribute(std::string_view tag_name, std::string_view name, std::string_view value) {
+  for (auto& tag : permitted_attribute_names) {
+    if (tag.tag_name == tag_name && std::find(tag.names.begin(), tag.names.end(), name) != tag.names.end()) {
+      for (auto& attribute : permitted_attribute_values) {
+        if (attribute.name == name) {
+          return attribute.validate(value);
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+// The ID link keywords matched by the scanner itself (see `DTextIdLinks`).
+static constexpr std::string_view builtin_id_link_keywords[] = {
+  "post", "forum", "topic", "comment", "dmail", "pool", "user", "user report", "tag alias", "tag implication",
+  "tag translation", "tag mass edit", "book", "series", "companion", "mod action", "record", "wiki", "twitter",
 };
 
-static unsigned char ascii_tolower(unsigned char c);
+// The ID link keywords matched by the scanner when they're followed by `/p<page>` (e.g. `pixiv #1234/p2`).
+static constexpr std::string_view paged_id_link_keywords[] = { "topic", "pixiv" };
+
+// The position of a keyword character in a `DTextIdLinks` trie node, or -1 if it can't appear in a keyword.
+static constexpr auto keyword_char_index = [] {
+  std::array<int8_t, 256> table;
+  table.fill(-1);
+
+  for (int c = 'a'; c <= 'z'; c++) {
+    table[c] = table[c - 'a' + 'A'] = c - 'a';
+  }
+
+  for (int c = '0'; c <= '9'; c++) {
+    table[c] = 26 + c - '0';
+  }
+
+  table[' '] = 36;
+  table['_'] = 37;
+  table['-'] = 38;
+  return table;
+}();
+
+// True for the characters of ID link keywords (letters, digits, spaces, `_` and `-`), bytes of multibyte UTF-8
+// characters, and tabs.
+static bool is_word_or_space(unsigned char c) {
+  return keyword_char_index[c] >= 0 || c >= 0x80 || c == '\t';
+}
+
+// Return the first `<`, `>`, `&` or `"` in the string, or the end of the string if there isn't one.
+static const char* find_html_special_char(const char* p, const char* end) {
+  return DText::SIMD::find_first_of(p, end, html_special_chars);
+}
+
+static std::string_view html_entity(char c) {
+  switch (c) {
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '&': return "&amp;";
+    case '"': return "&quot;";
+    default:  return {};
+  }
+}
+
+// Escape a string for HTML, passing the result to `append` in pieces. Copy the runs of text between special characters in
+// one go, and only escape the special characters themselves.
+template <typename Append>
+static void escape_html(const std::string_view string, Append append) {
+  const char* end = string.data() + string.size();
+
+  for (const char* p = string.data(); p < end; p++) {
+    const char* special = find_html_special_char(p, end);
+
+    if (special != p) {
+      append(std::string_view(p, special));
+    }
+
+    if (special == end) {
+      break;
+    }
+
+    append(html_entity(*special));
+    p = special;
+  }
+}
+
+static std::string html_escaped(const std::string_view string) {
+  std::string escaped;
+  escape_html(string, [&](std::string_view piece) { escaped += piece; });
+  return escaped;
+}
+
+DTextIdLinks::DTextIdLinks(const std::vector<Type>& types) {
+  nodes.emplace_back().next.fill(-1);
+  links.reserve(types.size());
+
+  for (auto& type : types) {
+    Link link = compile(type);
+    std::string lowercase_keyword;
+    size_t node = 0;
+
+    for (unsigned char c : type.keyword) {
+      int index = keyword_char_index[c];
+      lowercase_keyword += DText::ASCII::to_lower(c);
+
+      if (nodes[node].next[index] < 0) {
+        nodes[node].next[index] = nodes.size();
+        nodes.emplace_back().next.fill(-1);
+      }
+
+      node = nodes[node].next[index];
+    }
+
+    auto contains = [&](auto& keywords) { return std::find(std::begin(keywords), std::end(keywords), lowercase_keyword) != std::end(keywords); };
+    link.builtin = contains(builtin_id_link_keywords);
+    link.paged = contains(paged_id_link_keywords);
+
+    nodes[node].link = links.size();
+    links.push_back(std::move(link));
+  }
+}
+
+// Build the HTML for a link type. Raises DTextError if the keyword is invalid.
+DTextIdLinks::Link DTextIdLinks::compile(const Type& type) {
+  std::string_view keyword = type.keyword;
+
+  if (keyword.empty() || keyword.front() == ' ' || keyword.back() == ' ' || std::any_of(keyword.begin(), keyword.end(), [](unsigned char c) { return keyword_char_index[c] < 0; })) {
+    throw DTextError("invalid ID link keyword");
+  }
+
+  bool internal = type.url.starts_with('/');
+
+  std::string open = internal ? "<a class=\"dtext-link dtext-id-link dtext-" : "<a rel=\"external nofollow noreferrer\" class=\"dtext-link dtext-id-link dtext-";
+  open += html_escaped(type.name) + "-id-link\" href=\"";
+
+  return { internal, false, false, open, html_escaped(type.url), html_escaped(type.page), "\">" + html_escaped(type.keyword) + " #" };
+}
+
+// Return the link type for a keyword, or NULL if there isn't one.
+const DTextIdLinks::Link* DTextIdLinks::find(const std::string_view keyword) const {
+  size_t node = 0;
+
+  for (unsigned char c : keyword) {
+    int index = keyword_char_index[c];
+
+    if (index < 0 || nodes[node].next[index] < 0) {
+      return NULL;
+    }
+
+    node = nodes[node].next[index];
+  }
+
+  return nodes[node].link < 0 ? NULL : &links[nodes[node].link];
+}
+
+// Find the longest keyword followed by ` #` at the start of the text.
+DTextIdLinks::Match DTextIdLinks::match(const std::string_view text) const {
+  Match match = { NULL, 0, 0 };
+  size_t node = 0;
+  size_t i = 0;
+
+  for (; i < text.size(); i++) {
+    if (nodes[node].link >= 0 && text.substr(i).starts_with(" #")) {
+      match = { &links[nodes[node].link], i + 2, 0 };
+    }
+
+    int index = keyword_char_index[(unsigned char)text[i]];
+    if (index < 0 || nodes[node].next[index] < 0) {
+      break;
+    }
+
+    node = nodes[node].next[index];
+  }
+
+  match.lookahead = std::max(i, match.length);
+  return match;
+}
+
+// Match a path against a route like `posts/:id` or `post/show/:id/*` and return the `:id` (or `:title`), or an empty
+// string if the path doesn't match. Empty segments are ignored, so `/posts//1234` matches `posts/:id`, except at the end:
+// `/posts/1234/` only matches a route ending in `*`.
+static std::string_view match_route(std::string_view path, std::string_view route) {
+  bool trailing_slash = path.ends_with('/');
+  std::string_view id;
+
+  for (;;) {
+    std::string_view expected = DText::next_path_segment(route);
+    if (expected == "*") {
+      return id;
+    }
+
+    std::string_view segment = DText::next_path_segment(path);
+    if (expected.empty() || segment.empty()) {
+      return expected.empty() && segment.empty() && !trailing_slash ? id : std::string_view();
+    } else if (expected == ":id") {
+      if (!std::all_of(segment.begin(), segment.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        return {};
+      }
+
+      id = segment;
+    } else if (expected == ":title") {
+      id = segment;
+    } else if (segment != expected) {
+      return {};
+    }
+  }
+}
+
+DTextRoutes::DTextRoutes(const std::vector<Route>& routes) {
+  this->routes.reserve(routes.size());
+
+  for (auto& route : routes) {
+    int ids = 0;
+    bool rest = false;
+
+    for (std::string_view segment : DText::PathSegments(route.path)) {
+      if (rest || (segment.starts_with(':') && segment != ":id") || (segment.find('*') != std::string_view::npos && segment != "*")) {
+        throw DTextError("invalid route");
+      }
+
+      ids += segment == ":id";
+
+      rest = segment == "*";
+    }
+
+    if (ids != 1) {
+      throw DTextError("invalid route");
+    }
+
+    this->routes.push_back({ route.path, DTextIdLinks::compile(route.type), route.query, route.fragment });
+  }
+}
+
+// Return the link for the first route that matches the URL, and the ID from the URL, or NULL if none of them match.
+std::pair<const DTextIdLinks::Link*, std::string_view> DTextRoutes::match(const DText::URL& url) const {
+  for (auto& route : routes) {
+    if ((route.query || url.query.empty()) && (route.fragment || url.fragment.empty())) {
+      if (auto id = match_route(url.path, route.path); !id.empty()) {
+        return { &route.link, id };
+      }
+    }
+  }
+
+  return { NULL, {} };
+}
+
+// FNV-1a over the lowercased name, followed by a final mix so that the high and low bits are both usable.
+uint64_t DTextEmojiList::hash_name(const std::string_view name) {
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (unsigned char c : name) {
+    hash = (hash ^ DText::ASCII::to_lower(c)) * 0x100000001b3;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccd;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// The slot for a name in a bucket with the given seed.
+static size_t emoji_slot(uint64_t hash, uint32_t displacement, size_t size) {
+  hash ^= displacement * 0x9e3779b97f4a7c15;
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9;
+  hash ^= hash >> 32;
+  return hash % size;
+}
+
+// How many seeds to try for a bucket before giving up. A bucket almost always fits within a few hundred tries; this only
+// stops two names with the same hash from looping forever.
+static const uint32_t MAX_EMOJI_DISPLACEMENT = 1 << 20;
+
+// Build the table with the hash-and-displace method: the names are split into small buckets by hash, then starting
+// with the largest bucket, each bucket gets the first seed that puts all of its names in free slots.
+DTextEmojiList::DTextEmojiList(const std::vector<std::string_view>& names) {
+  std::vector<std::string> lowercase_names;
+
+  for (auto name : names) {
+    if (name.empty() || !std::all_of(name.begin(), name.end(), [](unsigned char c) { return keyword_char_index[c] >= 0 && c != ' ' && c != '-'; })) {
+      throw DTextError("invalid emoji name");
+    }
+
+    std::string& lowercase_name = lowercase_names.emplace_back(name);
+    DText::ASCII::to_lower(name, lowercase_name.data());
+  }
+
+  std::sort(lowercase_names.begin(), lowercase_names.end());
+  lowercase_names.erase(std::unique(lowercase_names.begin(), lowercase_names.end()), lowercase_names.end());
+
+  displacements.resize(lowercase_names.size() / 4 + 1);
+  slots.resize(lowercase_names.size() + lowercase_names.size() / 4 + 1);
+
+  std::vector<std::vector<uint64_t>> buckets(displacements.size());
+  std::vector<std::vector<const std::string*>> bucket_names(displacements.size());
+
+  for (auto& name : lowercase_names) {
+    uint64_t name_hash = hash_name(name);
+    size_t bucket = (name_hash >> 32) % buckets.size();
+
+    buckets[bucket].push_back(name_hash);
+    bucket_names[bucket].push_back(&name);
+  }
+
+  std::vector<size_t> order(buckets.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+  std::vector<bool> used(slots.size());
+  std::vector<size_t> bucket_slots;
+
+  for (size_t bucket : order) {
+    for (uint32_t displacement = 0; !buckets[bucket].empty(); displacement++) {
+      if (displacement == MAX_EMOJI_DISPLACEMENT) [[unlikely]] {
+        throw DTextError("can't build emoji list");
+      }
+
+      bucket_slots.clear();
+
+      for (uint64_t name_hash : buckets[bucket]) {
+        size_t slot = emoji_slot(name_hash, displacement, slots.size());
+
+        if (used[slot] || std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end()) {
+          break;
+        }
+
+        bucket_slots.push_back(slot);
+      }
+
+      if (bucket_slots.size() == buckets[bucket].size()) {
+        for (size_t i = 0; i < bucket_slots.size(); i++) {
+          used[bucket_slots[i]] = true;
+          slots[bucket_slots[i]] = *bucket_names[bucket][i];
+        }
+
+        displacements[bucket] = displacement;
+        break;
+      }
+    }
+  }
+}
+
+bool DTextEmojiList::contains(const std::string_view name) const {
+  uint64_t name_hash = hash_name(name);
+  uint32_t displacement = displacements[(name_hash >> 32) % displacements.size()];
+  const std::string& slot = slots[emoji_slot(name_hash, displacement, slots.size())];
+
+  return DText::ASCII::iequals(name, slot);
+}
+
+// FNV-1a over the lowercased name from the last character to the first, so that the hash of each parent domain
+// (`donmai.us` in `cdn.donmai.us`) is computed along the way.
+static uint64_t domain_hash_step(uint64_t hash, unsigned char c) {
+  return (hash ^ DText::ASCII::to_lower(c)) * 0x100000001b3;
+}
+
+void DTextDomains::add(std::string_view domain) {
+  bool subdomains = domain.starts_with("*.");
+  domain.remove_prefix(subdomains ? 2 : 0);
+
+  if (domain.empty()) {
+    return;
+  }
+
+  std::string name(domain);
+  DText::ASCII::to_lower(domain, name.data());
+
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto c = name.rbegin(); c != name.rend(); c++) {
+    hash = domain_hash_step(hash, *c);
+  }
+
+  entries.push_back({ hash, subdomains, name });
+}
+
+bool DTextDomains::contains(const std::string_view host) const {
+  if (entries.empty()) {
+    return false;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (size_t i = host.size(); i > 0; i--) {
+    hash = domain_hash_step(hash, host[i - 1]);
+
+    // `host.substr(i - 1)` is either the whole host or a parent domain of it.
+    if (i == 1 || host[i - 2] == '.') {
+      bool subdomain = i > 1;
+      auto entry = std::lower_bound(entries.begin(), entries.end(), hash, [](const Entry& entry, uint64_t hash) { return entry.hash < hash; });
+
+      for (; entry != entries.end() && entry->hash == hash; entry++) {
+        if (entry->subdomains == subdomain && DText::ASCII::iequals(host.substr(i - 1), entry->name)) {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+// The emoji lists registered with `register_emoji_list`, by name.
+static std::mutex emoji_lists_mutex;
+static std::unordered_map<std::string, std::shared_ptr<const DTextEmojiList>> emoji_lists;
 
 %%{
 machine dtext;
@@ -58,6 +687,7 @@ variable ts ts;
 variable te te;
 variable act act;
 variable stack (stack.data());
+getkey next_key();
 
 prepush {
   size_t len = stack.size();
@@ -336,7 +966,7 @@ basic_inline := |*
   open_u  => { dstack_open_element(INLINE_U, "<u>"); };
   close_u => { dstack_close_element(INLINE_U, { ts, te }); };
   eos;
-  any => { append_html_escaped(fc); };
+  any => { append_html_escaped(*p); };
 *|;
 
 inline := |*
@@ -363,8 +993,8 @@ inline := |*
 
   'dmail #'i id '/' dmail_key => { append_dmail_key_link({ a1, a2 }, { b1, b2 }); };
 
-  'topic #'i id '/p'i page => { append_paged_link("topic #", { a1, a2 }, "<a class=\"dtext-link dtext-id-link dtext-forum-topic-id-link\" href=\"", "/forums/", "?page=", { b1, b2 }); };
-  'pixiv #'i id '/p'i page => { append_paged_link("pixiv #", { a1, a2 }, "<a rel=\"external nofollow noreferrer\" class=\"dtext-link dtext-id-link dtext-pixiv-id-link\" href=\"", "https://www.pixiv.net/artworks/", "#", { b1, b2 }); };
+  'topic #'i id '/p'i page => { append_paged_link("topic", { a1, a2 }, "<a class=\"dtext-link dtext-id-link dtext-forum-topic-id-link\" href=\"", "/forums/", "?page=", { b1, b2 }); };
+  'pixiv #'i id '/p'i page => { append_paged_link("pixiv", { a1, a2 }, "<a rel=\"external nofollow noreferrer\" class=\"dtext-link dtext-id-link dtext-pixiv-id-link\" href=\"", "https://www.pixiv.net/artworks/", "#", { b1, b2 }); };
 
   basic_post_search_link => {
     append_post_search_link({ a1, a2 }, { b1, b2 }, { b1, b2 }, { d1, d2 });
@@ -375,11 +1005,11 @@ inline := |*
   };
 
   basic_wiki_link => {
-    append_wiki_link({ a1, a2 }, { b1, b2 }, { c1, c2 }, { b1, b2 }, { e1, e2 });
+    append_wiki_link({ a1, a2 }, { b1, b2 }, optional_match(c1, c2), { b1, b2 }, { e1, e2 });
   };
 
   aliased_wiki_link => {
-    append_wiki_link({ a1, a2 }, { b1, b2 }, { c1, c2 }, { d1, d2 }, { e1, e2 });
+    append_wiki_link({ a1, a2 }, { b1, b2 }, optional_match(c1, c2), { d1, d2 }, { e1, e2 });
   };
 
   basic_textile_link => {
@@ -478,7 +1108,7 @@ inline := |*
   };
 
   close_h => {
-    static element_t blocks[] = {
+    static constexpr element_t blocks[] = {
       BLOCK_H1, BLOCK_H2, BLOCK_H3,
       BLOCK_H4, BLOCK_H5, BLOCK_H6
     };
@@ -646,7 +1276,7 @@ inline := |*
   };
 
   any => {
-    append_html_escaped(fc);
+    append_html_escaped(*p);
   };
 *|;
 
@@ -659,7 +1289,7 @@ code := |*
   eos;
 
   any => {
-    append_html_escaped(fc);
+    append_html_escaped(*p);
   };
 *|;
 
@@ -672,7 +1302,7 @@ nodtext := |*
   eos;
 
   any => {
-    append_html_escaped(fc);
+    append_html_escaped(*p);
   };
 *|;
 
@@ -852,7 +1482,7 @@ main := |*
   };
 
   media_embed => {
-    const std::string_view caption = { c1, c2 };
+    const std::string_view caption = optional_match(c1, c2);
     const std::string_view prefix = { d1, d2 };
 
     append_media_embed({ b1, b2 }, { a1, a2 }, caption, !prefix.empty());
@@ -923,7 +1553,12 @@ main := |*
 %% write data;
 
 void StateMachine::dstack_push(element_t element) {
+  if (options.max_nesting && dstack.size() >= options.max_nesting) {
+    throw DTextError("too many nested elements");
+  }
+
   dstack.push_back(element);
+  scan_memo_invalidate(element);
 }
 
 element_t StateMachine::dstack_pop() {
@@ -933,6 +1568,7 @@ element_t StateMachine::dstack_pop() {
   } else {
     auto element = dstack.back();
     dstack.pop_back();
+    scan_memo_invalidate(element);
     return element;
   }
 }
@@ -958,19 +1594,48 @@ bool StateMachine::is_inline_element(element_t type) {
   return type >= INLINE;
 }
 
+// True if a link to this domain is an internal link. A URL without a domain only counts if `options.domain` isn't set.
+bool StateMachine::is_internal_domain(const std::string_view domain) {
+  return domain.empty() ? options.domain.empty() : domain_matcher.contains(domain);
+}
+
 bool StateMachine::is_internal_url(const std::string_view url) {
   if (url.starts_with("/")) {
     return true;
-  } else if (options.domain.empty() || url.empty()) {
-    return false;
+  }
+
+  // The domain name part of an http or https URL (`https://user@danbooru.donmai.us:443/posts`).
+  std::string_view host = url;
+  if (DText::ASCII::iequals(host.substr(0, 7), "http://")) {
+    host.remove_prefix(sizeof("http://") - 1);
+  } else if (DText::ASCII::iequals(host.substr(0, 8), "https://")) {
+    host.remove_prefix(sizeof("https://") - 1);
   } else {
-    // Matches the domain name part of a URL.
-    static const std::regex url_regex("^https?://(?:[^/?#]*@)?([^/?#:]+)", std::regex_constants::icase);
+    return false;
+  }
+
+  host = host.substr(0, host.find_first_of("/?#"));
+  host.remove_prefix(host.find('@') == std::string_view::npos ? 0 : host.rfind('@') + 1);
+  host = host.substr(0, host.find(':'));
+
+  return domain_matcher.contains(host);
+}
+
+// Check the size of the output, and add the output generated since the last call to the output digest. This is the only
+// place `max_output_size` is checked. It's called at the start of a token once `OUTPUT_CHUNK_SIZE` bytes of output have
+// been added (see `at_token_start`), after each cached block, and before the output is returned, so the output can only
+// go over the limit by about a chunk before parsing stops. The output is hashed while it's still in the CPU cache,
+// instead of in a separate pass at the end.
+void StateMachine::flush_output() {
+  if (options.max_output_size && output_returned + output.size() > options.max_output_size) [[unlikely]] {
+    throw DTextError("output too large");
+  }
 
-    std::match_results<std::string_view::const_iterator> matches;
-    std::regex_search(url.begin(), url.end(), matches, url_regex);
-    return matches[1] == options.domain;
+  if (digest_output) {
+    digest.update(std::string_view(output).substr(output_flushed));
   }
+
+  output_flushed = output.size();
 }
 
 void StateMachine::append(const auto c) {
@@ -992,36 +1657,76 @@ void StateMachine::append_html_escaped(char s) {
 }
 
 void StateMachine::append_html_escaped(const std::string_view string) {
-  for (const unsigned char c : string) {
-    append_html_escaped(c);
-  }
+  escape_html(string, [this](std::string_view piece) { append(piece); });
 }
 
+// Copy runs of unreserved characters in one go, and escape runs of other characters (such as the bytes of a Japanese
+// tag name) through a small buffer.
 void StateMachine::append_uri_escaped(const std::string_view string) {
-  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(string.data());
+  const unsigned char* end = p + string.size();
 
-  for (const unsigned char c : string) {
-    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c == '~') {
-      append(c);
-    } else {
-      append('%');
-      append(hex[c >> 4]);
-      append(hex[c & 0x0F]);
+  while (p < end) {
+    const unsigned char* run = p;
+    while (p < end && uri_unreserved_table[*p]) {
+      p++;
     }
-  }
-}
 
-void StateMachine::append_relative_url(const auto url) {
-  if ((url[0] == '/' || url[0] == '#') && !options.base_url.empty()) {
-    append_html_escaped(options.base_url);
-  }
+    if (p > run) {
+      append(std::string_view(reinterpret_cast<const char*>(run), p - run));
+    }
 
-  append_html_escaped(url);
-}
+    char escaped[96];
+    size_t size = 0;
 
-void StateMachine::append_absolute_link(const std::string_view url, const std::string_view title, bool internal_url, bool escape_title) {
-  if (internal_url) {
-    append("<a class=\"dtext-link\" href=\"");
+    for (; p < end && !uri_unreserved_table[*p]; p++) {
+      memcpy(escaped + size, uri_escapes[*p].data(), 3);
+      size += 3;
+
+      if (size == sizeof(escaped)) {
+        append(std::string_view(escaped, size));
+        size = 0;
+      }
+    }
+
+    if (size > 0) {
+      append(std::string_view(escaped, size));
+    }
+  }
+}
+
+// Append the string after normalizing it with one of the `DText::ASCII` functions, a piece at a time through a small
+// buffer. The result must not need escaping (as with `normalize_anchor`).
+void StateMachine::append_normalized(const std::string_view string, char* (*normalize)(std::string_view, char*)) {
+  char buffer[256];
+
+  for (size_t i = 0; i < string.size(); i += sizeof(buffer)) {
+    std::string_view piece = string.substr(i, sizeof(buffer));
+    append(std::string_view(buffer, normalize(piece, buffer)));
+  }
+}
+
+// Like `append_normalized`, but percent-encode the result.
+void StateMachine::append_uri_escaped_normalized(const std::string_view string, char* (*normalize)(std::string_view, char*)) {
+  char buffer[256];
+
+  for (size_t i = 0; i < string.size(); i += sizeof(buffer)) {
+    std::string_view piece = string.substr(i, sizeof(buffer));
+    append_uri_escaped(std::string_view(buffer, normalize(piece, buffer)));
+  }
+}
+
+void StateMachine::append_relative_url(const auto url) {
+  if ((url[0] == '/' || url[0] == '#') && !options.base_url.empty()) {
+    append_html_escaped(options.base_url);
+  }
+
+  append_html_escaped(url);
+}
+
+void StateMachine::append_absolute_link(const std::string_view url, const std::string_view title, bool internal_url, bool escape_title) {
+  if (internal_url) {
+    append("<a class=\"dtext-link\" href=\"");
   } else if (url == title) {
     append("<a rel=\"external nofollow noreferrer\" class=\"dtext-link dtext-external-link\" href=\"");
   } else {
@@ -1055,11 +1760,8 @@ void StateMachine::append_mention(const std::string_view name) {
 }
 
 void StateMachine::append_emoji(const std::string_view name, const std::string_view mode) {
-  std::string lowercase_name(name);
-  std::transform(name.begin(), name.end(), lowercase_name.begin(), &ascii_tolower);
-
   dstack_open_element(INLINE_EMOJI, "<emoji data-name=\"");
-  append_uri_escaped(lowercase_name);
+  append_uri_escaped_normalized(name, DText::ASCII::to_lower);
   append("\" data-mode=\"");
   append_uri_escaped(mode);
   append("\">");
@@ -1067,6 +1769,13 @@ void StateMachine::append_emoji(const std::string_view name, const std::string_v
 }
 
 void StateMachine::append_id_link(const char * title, const char * id_name, const char * url, const std::string_view id) {
+  if (options.id_links) {
+    if (auto link = options.id_links->find(title)) {
+      append_id_link(*link, id);
+      return;
+    }
+  }
+
   if (url[0] == '/') {
     append("<a class=\"dtext-link dtext-id-link dtext-");
     append(id_name);
@@ -1087,6 +1796,20 @@ void StateMachine::append_id_link(const char * title, const char * id_name, cons
   append("</a>");
 }
 
+void StateMachine::append_id_link(const DTextIdLinks::Link& link, const std::string_view id) {
+  append(link.open);
+
+  if (link.internal && !options.base_url.empty()) {
+    append_html_escaped(options.base_url);
+  }
+
+  append(link.url);
+  append_uri_escaped(id);
+  append(link.title);
+  append_html_escaped(id);
+  append("</a>");
+}
+
 void StateMachine::append_bare_unnamed_url(const std::string_view url) {
   auto [trimmed_url, leftovers] = trim_url(url);
   append_unnamed_url(trimmed_url);
@@ -1096,62 +1819,57 @@ void StateMachine::append_bare_unnamed_url(const std::string_view url) {
 void StateMachine::append_unnamed_url(const std::string_view url) {
   DText::URL parsed_url(url);
 
-  if (options.internal_domains.find(std::string(parsed_url.domain)) != options.internal_domains.end()) {
+  if (internal_domain_matcher.contains(parsed_url.domain)) {
     append_internal_url(parsed_url);
   } else if (parsed_url.scheme == "mailto") {
     auto title = url;
     title.remove_prefix(sizeof("mailto"));
-    append_absolute_link(url, title, parsed_url.domain == options.domain);
+    append_absolute_link(url, title, is_internal_domain(parsed_url.domain));
   } else {
-    append_absolute_link(url, url, parsed_url.domain == options.domain);
+    append_absolute_link(url, url, is_internal_domain(parsed_url.domain));
   }
 }
 
+// The internal URLs that are shortened to ID links. The route is followed by the ID link type, and whether URLs with a
+// query string or a fragment are shortened.
+static constexpr struct {
+  std::string_view route;
+  const char* title;
+  const char* id_name;
+  const char* url;
+  bool query;
+  bool fragment;
+} internal_routes[] = {
+  { "posts/:id",       "post",    "post",       "/posts/",    true,  false }, // https://danbooru.donmai.us/posts/6000000#comment_2288996
+  { "pools/:id",       "pool",    "pool",       "/pools/",    false, true  }, // https://danbooru.donmai.us/pools/903?page=2
+  { "comments/:id",    "comment", "comment",    "/comments/", true,  true  },
+  { "forums/:id",      "forum",   "forum-post", "/forums/",   true,  true  },
+  { "users/:id",       "user",    "user",       "/users/",    true,  true  },
+  { "notes/:id",       "note",    "note",       "/notes/",    true,  true  },
+  { "wiki/:id",        "wiki",    "wiki-page",  "/wiki/",     true,  false }, // http://danbooru.donmai.us/wiki_pages/10933#dtext-self-upload
+  { "post/show/:id/*", "post",    "post",       "/posts/",    true,  true  }, // http://danbooru.donmai.us/post/show/1234/touhou
+};
+
 void StateMachine::append_internal_url(const DText::URL& url) {
-  auto path_components = url.path_components();
-  auto query = url.query;
-  auto fragment = url.fragment;
-
-  if (path_components.size() == 2) {
-    auto controller = path_components.at(0);
-    auto id = path_components.at(1);
-
-    if (!id.empty() && std::all_of(id.begin(), id.end(), ::isdigit)) {
-      if (controller == "posts" && fragment.empty()) {
-        // https://danbooru.donmai.us/posts/6000000#comment_2288996
-        return append_id_link("post", "post", "/posts/", id);
-      } else if (controller == "pools" && query.empty()) {
-        // https://danbooru.donmai.us/pools/903?page=2
-        return append_id_link("pool", "pool", "/pools/", id);
-      } else if (controller == "comments") {
-        return append_id_link("comment", "comment", "/comments/", id);
-      } else if (controller == "forums") {
-        return append_id_link("forum", "forum-post", "/forums/", id);
-      } else if (controller == "users") {
-        return append_id_link("user", "user", "/users/", id);
-      } else if (controller == "notes") {
-        return append_id_link("note", "note", "/notes/", id);
-      } else if (controller == "wiki" && fragment.empty()) {
-        // http://danbooru.donmai.us/wiki_pages/10933#dtext-self-upload
-        return append_id_link("wiki", "wiki-page", "/wiki/", id);
-      }
-    } else if (controller == "wiki" && fragment.empty()) {
-      return append_wiki_link({}, id, {}, id, {});
-    }
-  } else if (path_components.size() >= 3) {
-    // http://danbooru.donmai.us/post/show/1234/touhou
-    auto controller = path_components.at(0);
-    auto action = path_components.at(1);
-    auto id = path_components.at(2);
-
-    if (!id.empty() && std::all_of(id.begin(), id.end(), ::isdigit)) {
-      if (controller == "post" && action == "show") {
-        return append_id_link("post", "post", "/posts/", id);
+  if (options.routes) {
+    if (auto [link, id] = options.routes->match(url); link) {
+      return append_id_link(*link, id);
+    }
+  }
+
+  for (auto& route : internal_routes) {
+    if ((route.query || url.query.empty()) && (route.fragment || url.fragment.empty())) {
+      if (auto id = match_route(url.path, route.route); !id.empty()) {
+        return append_id_link(route.title, route.id_name, route.url, id);
       }
     }
   }
 
-  append_absolute_link(url.url, url.url, url.domain == options.domain);
+  if (auto title = match_route(url.path, "wiki/:title"); !title.empty() && url.fragment.empty()) {
+    return append_wiki_link({}, title, {}, title, {});
+  }
+
+  append_absolute_link(url.url, url.url, is_internal_domain(url.domain));
 }
 
 void StateMachine::append_named_url(const std::string_view url, const std::string_view title) {
@@ -1197,7 +1915,7 @@ void StateMachine::append_post_search_link(const std::string_view prefix, const
 
   // {{pokemon_(creature)|}} -> {{pokemon_(creature)|pokemon}}
   if (title.empty()) {
-    std::regex_replace(std::back_inserter(normalized_title), search.begin(), search.end(), tag_qualifier_regex, "");
+    normalized_title.append(strip_tag_qualifier(search));
   }
 
   // {{cat}}s -> {{cat|cats}}
@@ -1212,20 +1930,11 @@ void StateMachine::append_post_search_link(const std::string_view prefix, const
 }
 
 void StateMachine::append_wiki_link(const std::string_view prefix, const std::string_view tag, const std::string_view anchor, const std::string_view title, const std::string_view suffix) {
-  auto normalized_tag = std::string(tag);
   auto title_string = std::string(title);
 
-  // "Kantai Collection" -> "kantai_collection"
-  std::transform(normalized_tag.cbegin(), normalized_tag.cend(), normalized_tag.begin(), [](unsigned char c) { return c == ' ' ? '_' : ascii_tolower(c); });
-
-  // [[2019]] -> [[~2019]]
-  if (std::all_of(normalized_tag.cbegin(), normalized_tag.cend(), ::isdigit)) {
-    normalized_tag.insert(0, "~");
-  }
-
   // Pipe trick: [[Kaga (Kantai Collection)|]] -> [[kaga_(kantai_collection)|Kaga]]
   if (title_string.empty()) {
-    std::regex_replace(std::back_inserter(title_string), tag.cbegin(), tag.cend(), tag_qualifier_regex, "");
+    title_string.append(strip_tag_qualifier(tag));
   }
 
   // 19[[60s]] -> [[60s|1960s]]
@@ -1240,13 +1949,18 @@ void StateMachine::append_wiki_link(const std::string_view prefix, const std::st
 
   append("<a class=\"dtext-link dtext-wiki-link\" href=\"");
   append_relative_url("/wiki/");
-  append_uri_escaped(normalized_tag);
+
+  // [[2019]] -> [[~2019]]
+  if (DText::ASCII::is_digits(tag)) {
+    append("~");
+  }
+
+  // "Kantai Collection" -> "kantai_collection"
+  append_uri_escaped_normalized(tag, DText::ASCII::normalize_tag);
 
   if (!anchor.empty()) {
-    std::string normalized_anchor(anchor);
-    std::transform(normalized_anchor.begin(), normalized_anchor.end(), normalized_anchor.begin(), [](char c) { return isalnum(c) ? ascii_tolower(c) : '-'; });
-    append_html_escaped("#dtext-");
-    append_html_escaped(normalized_anchor);
+    append("#dtext-");
+    append_normalized(anchor, DText::ASCII::normalize_anchor);
   }
 
   append("\">");
@@ -1255,10 +1969,21 @@ void StateMachine::append_wiki_link(const std::string_view prefix, const std::st
 
   wiki_pages.insert(std::string(tag));
 
+  if (block_start >= 0) {
+    block_wiki_pages.emplace_back(tag);
+  }
+
   clear_matches();
 }
 
 void StateMachine::append_paged_link(const char * title, const std::string_view id, const char * tag, const char * href, const char * param, const std::string_view page) {
+  if (options.id_links) {
+    if (auto link = options.id_links->find(title); link && !link->page.empty()) {
+      append_paged_link(*link, id, page);
+      return;
+    }
+  }
+
   append(tag);
   append_relative_url(href);
   append(id);
@@ -1266,12 +1991,31 @@ void StateMachine::append_paged_link(const char * title, const std::string_view
   append(page);
   append("\">");
   append(title);
+  append(" #");
   append(id);
   append("/p");
   append(page);
   append("</a>");
 }
 
+void StateMachine::append_paged_link(const DTextIdLinks::Link& link, const std::string_view id, const std::string_view page) {
+  append(link.open);
+
+  if (link.internal && !options.base_url.empty()) {
+    append_html_escaped(options.base_url);
+  }
+
+  append(link.url);
+  append_uri_escaped(id);
+  append(link.page);
+  append(page);
+  append(link.title);
+  append_html_escaped(id);
+  append("/p");
+  append(page);
+  append("</a>");
+}
+
 void StateMachine::append_dmail_key_link(const std::string_view dmail_id, const std::string_view dmail_key) {
   append("<a class=\"dtext-link dtext-id-link dtext-dmail-id-link\" href=\"");
   append_relative_url("/dmails/");
@@ -1321,7 +2065,7 @@ void StateMachine::append_block_code(const std::string_view language) {
 }
 
 void StateMachine::append_header(char header, const std::string_view id) {
-  static element_t blocks[] = {BLOCK_H1, BLOCK_H2, BLOCK_H3, BLOCK_H4, BLOCK_H5, BLOCK_H6};
+  static constexpr element_t blocks[] = {BLOCK_H1, BLOCK_H2, BLOCK_H3, BLOCK_H4, BLOCK_H5, BLOCK_H6};
   element_t block = blocks[header - '1'];
 
   dstack_close_leaf_blocks();
@@ -1331,13 +2075,14 @@ void StateMachine::append_header(char header, const std::string_view id) {
     append_block(header);
     append_block(">");
   } else {
-    auto normalized_id = std::string(id);
-    std::transform(id.begin(), id.end(), normalized_id.begin(), [](char c) { return isalnum(c) ? ascii_tolower(c) : '-'; });
-
     dstack_open_element(block, "<h");
     append_block(header);
     append_block(" id=\"dtext-");
-    append_block(normalized_id);
+
+    if (!options.f_inline) {
+      append_normalized(id, DText::ASCII::normalize_anchor);
+    }
+
     append_block("\">");
   }
 
@@ -1400,18 +2145,13 @@ void StateMachine::dstack_open_element(element_t type, const char * html) {
 }
 
 void StateMachine::dstack_append_element_attributes(std::string_view tag_name) {
-  auto& permitted_names = permitted_attribute_names.at(tag_name);
   for (auto& [name, value] : tag_attributes) {
-    if (permitted_names.find(name) != permitted_names.end()) {
-      auto validate_value = permitted_attribute_values.at(name);
-
-      if (validate_value(value)) {
-        append_block(" ");
-        append_block_html_escaped(name);
-        append_block("=\"");
-        append_block_html_escaped(value);
-        append_block("\"");
-      }
+    if (is_permitted_attribute(tag_name, name, value)) {
+      append_block(" ");
+      append_block_html_escaped(name);
+      append_block("=\"");
+      append_block_html_escaped(value);
+      append_block("\"");
     }
   }
 
@@ -1422,24 +2162,8 @@ void StateMachine::dstack_open_element_attributes(element_t type, std::string_vi
   dstack_push(type);
   append_block("<");
   append_block(tag_name);
-
-  auto& permitted_names = permitted_attribute_names.at(tag_name);
-  for (auto& [name, value] : tag_attributes) {
-    if (permitted_names.find(name) != permitted_names.end()) {
-      auto validate_value = permitted_attribute_values.at(name);
-
-      if (validate_value(value)) {
-        append_block(" ");
-        append_block_html_escaped(name);
-        append_block("=\"");
-        append_block_html_escaped(value);
-        append_block("\"");
-      }
-    }
-  }
-
+  dstack_append_element_attributes(tag_name);
   append_block(">");
-  tag_attributes.clear();
 }
 
 bool StateMachine::dstack_close_element(element_t type, const std::string_view tag_name) {
@@ -1611,6 +2335,16 @@ void StateMachine::dstack_close_list() {
   }
 }
 
+// Return the text of a match in an optional part of a rule, or an empty string if the part didn't match. The match is
+// then either unset or left over from an earlier token, possibly with its end before its start.
+std::string_view StateMachine::optional_match(const char* begin, const char* end) {
+  if (begin && begin >= ts && begin <= end && end <= te) {
+    return { begin, end };
+  } else {
+    return {};
+  }
+}
+
 void StateMachine::clear_matches() {
   a1 = NULL;
   a2 = NULL;
@@ -1630,11 +2364,454 @@ void StateMachine::clear_matches() {
   h2 = NULL;
 }
 
+// Do the work that happens between tokens, before the scanner reads the first character of the next one: flush the
+// output, note where a failed lookahead ended, stop or resume at block boundaries, and skip over text that can't start
+// a token. This may move `p` forward, or throw `SplitPoint` or `MoreInputNeeded` to stop the scanner here.
+void StateMachine::at_token_start() {
+  if (output.size() - output_flushed >= OUTPUT_CHUNK_SIZE) {
+    flush_output();
+  }
+
+  // The last token looked ahead past its end and failed. The tokens that start before that point will scan the same
+  // text again, so memoize their lookaheads.
+  if (scan_max > te) {
+    failed_lookahead_end = std::max(failed_lookahead_end, scan_max);
+  }
+
+  while (split_blocks) {
+    if (split_at && p >= split_at) {
+      throw SplitPoint();
+    }
+
+    if (!at_block_boundary()) {
+      break;
+    }
+
+    // Matches left over from earlier blocks are cleared, so that a block parses the same way no matter where the
+    // document is split (see `parse_parallel`). Stale matches are never used (see `optional_match`), so this doesn't
+    // change the output.
+    clear_matches();
+    tag_attributes.clear();
+
+    if (record_blocks && (blocks.empty() || blocks.back().input < size_t(p - pb))) {
+      blocks.push_back({ size_t(p - pb), output.size(), size_t(scan_max - pb) });
+    }
+
+    if (!options.f_block_cache || !reuse_cached_block()) {
+      break;
+    }
+  }
+
+  if (cs == dtext_en_code || cs == dtext_en_nodtext || cs == dtext_en_basic_inline) {
+    skip_escaped_text();
+  }
+
+  while (cs == dtext_en_inline) {
+    skip_plain_text();
+
+    if (!options.id_links || !match_id_link()) {
+      break;
+    }
+  }
+}
+
+// Return the next input character for the scanner, at the start of a token or during a long lookahead (see `next_key`).
+// At the start of a token, this first calls `at_token_start`; the rest is memoization of long lookaheads.
+//
+// Rules like `markdown_link` or `delimited_mention` can scan to the end of the line looking for a terminator, then fall
+// back to `any` and rescan the same text from the next character. To keep this linear, we remember the (state,
+// position) pairs a failed lookahead passed through after its last match, along with where it eventually failed. If a
+// later token reaches one of those pairs, the scanner is bound to follow the same path to the same dead end without
+// matching anything longer, so we jump straight to the failure point (replaying the matches set along the way) and let
+// it backtrack from there.
+//
+// Paths are only recorded once a lookahead has failed, for the tokens that rescan its text, and only at every
+// `MEMOIZED_LOOKAHEAD_STRIDE`th position. Two scans that reach the same pair follow the same path from there on, so they
+// still meet at the next sampled position.
+char StateMachine::scan_key() {
+  if (options.max_steps && ++steps > options.max_steps) [[unlikely]] {
+    throw DTextError("input too complex");
+  }
+
+  if (p == ts) {
+    at_token_start();
+
+    // A new token is starting (or the last one finished); the previous token ended at te.
+    if (!scan_trail.empty()) {
+      auto [fail_cs, fail_p] = scan_trail.back();
+
+      if (fail_p > te - pb) {
+        scan_failures.push_back({ fail_cs, fail_p, scan_trail_marks, scan_trail_mark_steps });
+
+        for (size_t step = 0; step < scan_trail.size(); step++) {
+          auto [state, pos] = scan_trail[step];
+
+          if (pos > te - pb) {
+            scan_memo.emplace(scan_memo_key(state, pos), std::make_pair(scan_failures.size() - 1, step));
+          }
+        }
+      }
+
+      scan_trail.clear();
+    }
+  } else if (ts < failed_lookahead_end && p - ts > MIN_MEMOIZED_LOOKAHEAD && (p - pb) % MEMOIZED_LOOKAHEAD_STRIDE == 0) {
+    auto it = scan_memo.find(scan_memo_key(cs, p - pb));
+
+    if (it != scan_memo.end()) {
+      auto [index, step] = it->second;
+      auto marks = save_matches();
+      auto& failure = scan_failures[index];
+
+      for (size_t i = 0; i < marks.size(); i++) {
+        if (failure.mark_steps[i] != SIZE_MAX && failure.mark_steps[i] >= step) {
+          marks[i] = pb + failure.marks[i];
+        }
+      }
+
+      restore_matches(marks);
+      cs = failure.cs;
+      p = pb + failure.p;
+    } else {
+      auto marks = match_offsets();
+
+      if (scan_trail.empty()) {
+        scan_trail_mark_steps.fill(SIZE_MAX);
+      } else {
+        for (size_t i = 0; i < marks.size(); i++) {
+          if (marks[i] != scan_trail_marks[i]) {
+            scan_trail_mark_steps[i] = scan_trail.size() - 1;
+          }
+        }
+      }
+
+      scan_trail.emplace_back(cs, p - pb);
+      scan_trail_marks = marks;
+    }
+  }
+
+  scan_max = std::max(scan_max, p);
+  return *p;
+}
+
+// Return true if the scanner is about to start a top-level block after a blank line, in the same state as at the start
+// of a document.
+bool StateMachine::at_block_boundary() {
+  return cs == dtext_en_main && top == 0 && dstack.empty() && !header_mode && p - pb >= 2 && p[-1] == '\n' && p[-2] == '\n';
+}
+
+// Build a bitmap of the structural bytes in the input (see `skip_plain_text`).
+void StateMachine::build_structural_index() {
+  size_t size = pe - pb;
+  structural_index.assign(size / 64 + 1, 0);
+  DText::SIMD::build_bitmap(pb, size, structural_chars, structural_index.data());
+  structural_bits = structural_index.data();
+}
+
+// Return the first structural byte at or after `from`, or the end of the input if there isn't one. Uses the structural
+// index if there is one, or else searches the input directly.
+const char* StateMachine::find_structural_char(const char* from) {
+  if (!structural_bits) {
+    return DText::SIMD::find_first_of(from, pe, structural_chars);
+  }
+
+  size_t i = from - pb;
+  size_t words = (pe - pb) / 64 + 1;
+  uint64_t bits = structural_bits[i / 64] & (~uint64_t(0) << (i % 64));
+
+  for (size_t word = i / 64; word < words; bits = structural_bits[++word]) {
+    if (bits) {
+      return std::min(pb + word * 64 + std::countr_zero(bits), pe);
+    }
+  }
+
+  return pe;
+}
+
+// Called at the start of each token in the [code], [nodtext] and basic inline scanners. Escape the text up to the next
+// place a token other than a single character could start, or the end of the input, and skip over it. Every other
+// character is a token of its own that's escaped as is, so this is the same as scanning it one character at a time.
+//
+// In [code] and [nodtext], that's a closing tag (`\n[/code]`, `[/code]` or `</code>`). In the basic inline scanner, which
+// is used for link titles, it's any `[` or `<` (`[b]`, `</i>`).
+//
+// The last character of the buffer is left to the scanner, since the input may continue in the next chunk of a stream.
+// Nothing is skipped if the scanner is going back over a token it already matched part of (`te` is past `p`), which
+// happens when a token is cut off by the end of a chunk.
+void StateMachine::skip_escaped_text() {
+  const char* end = p;
+
+  if (te && te > p) {
+    return;
+  }
+
+  if (cs == dtext_en_basic_inline) {
+    end = DText::SIMD::find_first_of(p, pe - 1, basic_inline_stop_chars);
+  } else {
+    for (;; end++) {
+      end = DText::SIMD::find_first_of(end, pe - 1, verbatim_stop_chars);
+
+      if (end == pe - 1 || *end == '\0') {
+        break;
+      } else if (*end == '\n' ? (end[1] == '[' || end[1] == '<') : end[1] == '/') {
+        break;
+      }
+    }
+  }
+
+  if (p < end) {
+    count_skipped_steps(end);
+    append_html_escaped({ p, end });
+    p = ts = end;
+  }
+}
+
+// Count the characters from `p` to `end`, which are skipped without the scanner reading them, toward `max_steps`.
+void StateMachine::count_skipped_steps(const char* end) {
+  if (options.max_steps && (steps += end - p) > options.max_steps) [[unlikely]] {
+    throw DTextError("input too complex");
+  }
+}
+
+// Called at the start of each token in the inline scanner. Copy the plain text ahead to the output and skip over it, so
+// that the scanner only has to run where something other than plain text can start.
+//
+// Every token other than plain text starts with a structural byte, or with words and spaces followed by a structural
+// byte (`post #1234`, `foo-bar #1234`, `https://`, `foo[[bar]]`, ` [/spoiler]`). So the text up to the next structural
+// byte is plain text, except for any words and spaces right before it. The skipped text ends with a punctuation character that isn't
+// a structural byte, so no token starting inside it can reach past it, and it's copied as is because it doesn't
+// contain any characters that need escaping.
+void StateMachine::skip_plain_text() {
+  // The input isn't complete until the last chunk of a stream has been fed.
+  if (eof != pe) {
+    return;
+  }
+
+  if (options.f_structural_index && !structural_bits) {
+    build_structural_index();
+  }
+
+  if (p < plain_text_start || p >= next_structural) {
+    plain_text_start = p;
+    next_structural = find_structural_char(p);
+    plain_text_end = next_structural;
+
+    while (plain_text_end > p && is_word_or_space(plain_text_end[-1])) {
+      plain_text_end--;
+    }
+  }
+
+  if (p < plain_text_end) {
+    count_skipped_steps(plain_text_end);
+    append({ p, plain_text_end });
+    p = ts = plain_text_end;
+  }
+}
+
+// Called at the start of each token in the inline scanner when `id_links` is set. If an ID link with a keyword the
+// scanner doesn't know itself starts here, append it, skip over it and return true. This works the same as adding a `'keyword #'i id`
+// rule to the scanner: no other rule can match text that starts with a word followed by ` #`, except `alnum+`, which is
+// shorter.
+bool StateMachine::match_id_link() {
+  // In a stream, the link may go on in the next chunk. If anything up to `end` is past the end of the buffer, wait for
+  // the next chunk and match the link again from the same place.
+  auto wait_for_input = [&](const char* end) {
+    if (eof != pe && end >= pe) {
+      throw MoreInputNeeded();
+    }
+  };
+
+  auto [link, length, lookahead] = options.id_links->match({ p, size_t(pe - p) });
+  scan_max = std::max(scan_max, p + lookahead);
+  wait_for_input(p + lookahead + 1);
+
+  if (!link || link->builtin) {
+    return false;
+  }
+
+  // id = (alnum{11} | digit+)
+  const char* id = p + length;
+  size_t digits = 0;
+  size_t alnums = 0;
+
+  while (id + digits < pe && DText::ASCII::is_digit(id[digits])) {
+    digits++;
+  }
+
+  while (alnums < 11 && id + alnums < pe && DText::ASCII::is_alnum(id[alnums])) {
+    alnums++;
+  }
+
+  size_t id_length = std::max(digits, alnums == 11 ? alnums : 0);
+  scan_max = std::max(scan_max, std::min(id + std::max(digits, alnums) + 2, pe - 1));
+  wait_for_input(id + std::max(digits, alnums) + 2);
+
+  // page = '/p'i digit+
+  const char* page = id + id_length + 2;
+  size_t page_length = 0;
+
+  if (id_length > 0 && pe - id - id_length > 2 && id[id_length] == '/' && (id[id_length + 1] == 'p' || id[id_length + 1] == 'P')) {
+    while (page + page_length < pe && DText::ASCII::is_digit(page[page_length])) {
+      page_length++;
+    }
+
+    scan_max = std::max(scan_max, std::min(page + page_length, pe - 1));
+    wait_for_input(page + page_length);
+  }
+
+  // `pixiv #1234/p2` is matched by the scanner.
+  if (id_length == 0 || (link->paged && page_length > 0)) {
+    return false;
+  }
+
+  count_skipped_steps(page_length > 0 && !link->page.empty() ? page + page_length : id + id_length);
+
+  if (page_length > 0 && !link->page.empty()) {
+    append_paged_link(*link, { id, id_length }, { page, page_length });
+    p = ts = page + page_length;
+  } else {
+    append_id_link(*link, { id, id_length });
+    p = ts = id + id_length;
+  }
+
+  return true;
+}
+
+// Called at a block boundary when the block cache is enabled. Add the block that ended here to the cache, then look up
+// the block that starts here. If it's cached, append its HTML and skip to the end of it, which is the next block
+// boundary; since the scanner is in the same state at every block boundary, this gives the same output as parsing it.
+//
+// A block is cached along with the first character after it, which the scanner reads to find the end of the blank
+// lines before it. The block is only added to the cache if the scanner didn't look any further ahead than that, so its
+// HTML depends on nothing but the cached text.
+bool StateMachine::reuse_cached_block() {
+  if (block_start >= 0 && scan_max <= p && p - pb - block_start >= ptrdiff_t(MIN_CACHED_BLOCK_SIZE)) {
+    auto input = std::string_view(pb + block_start, p - pb - block_start + 1);
+    auto html = std::string_view(output).substr(block_output);
+    block_cache.insert({ block_key, options_id(), std::string(input), std::string(html), std::move(block_wiki_pages) });
+  }
+
+  block_start = -1;
+  block_wiki_pages.clear();
+
+  // The first paragraph of the block, up to the first character after the blank lines that end it.
+  auto text = std::string_view(p, pe - p);
+  size_t blank_line = text.find("\n\n");
+  size_t end = text.find_first_not_of('\n', blank_line);
+
+  if (blank_line == text.npos || end == text.npos || text[end] == '\0') {
+    return false;
+  }
+
+  uint64_t key = BlockCache::key(options_id(), text.substr(0, end + 1));
+
+  if (auto block = block_cache.lookup(key, options_id(), text)) {
+    append(block->html);
+    wiki_pages.insert(block->wiki_pages.begin(), block->wiki_pages.end());
+    flush_output();
+
+    p = ts = p + block->input.size() - 1;
+    return true;
+  }
+
+  block_start = p - pb;
+  block_key = key;
+  block_output = output.size();
+  return false;
+}
+
+// The number of the options that affect the output, for the block cache.
+uint64_t StateMachine::options_id() {
+  if (!block_options_id) {
+    block_options_id = block_cache.options_id(options_fingerprint());
+  }
+
+  return block_options_id;
+}
+
+// A string that's the same for two sets of options if and only if they give the same output.
+std::string StateMachine::options_fingerprint() {
+  std::vector<std::string_view> internal_domains(options.internal_domains.begin(), options.internal_domains.end());
+  std::vector<std::string_view> emojis(options.emojis.begin(), options.emojis.end());
+  std::sort(internal_domains.begin(), internal_domains.end());
+  std::sort(emojis.begin(), emojis.end());
+
+  std::string fingerprint;
+  fingerprint += options.f_inline ? 'i' : '-';
+  fingerprint += options.f_mentions ? 'm' : '-';
+  fingerprint += options.f_media_embeds ? 'e' : '-';
+  fingerprint += std::to_string(options.max_nesting) + '\0' + options.base_url + '\0' + options.domain + '\0';
+
+  for (auto domain : internal_domains) {
+    fingerprint.append(domain).append(1, '\0');
+  }
+
+  fingerprint += '\0';
+
+  for (auto emoji : emojis) {
+    fingerprint.append(emoji).append(1, '\0');
+  }
+
+  if (options.id_links) {
+    fingerprint += std::to_string(options.id_links->id());
+  }
+
+  if (options.routes) {
+    fingerprint += '\0' + std::to_string(options.routes->id());
+  }
+
+  if (options.emoji_list) {
+    fingerprint += '\0' + std::to_string(options.emoji_list->id());
+  }
+
+  return fingerprint;
+}
+
+uint64_t StateMachine::scan_memo_key(int state, ptrdiff_t pos) {
+  return (uint64_t(pos) << 32) | uint32_t(state);
+}
+
+// The lookahead memo is only valid as long as the `in_quote`, `in_expand`, `in_div` and `in_spoiler` conditions can't
+// change, so forget it when one of those blocks is opened or closed.
+void StateMachine::scan_memo_invalidate(element_t element) {
+  if ((element == BLOCK_QUOTE || element == BLOCK_EXPAND || element == BLOCK_DIV || element == BLOCK_SPOILER) && !scan_memo.empty()) {
+    scan_memo.clear();
+    scan_failures.clear();
+  }
+}
+
+std::array<const char*, 16> StateMachine::save_matches() {
+  return { a1, a2, b1, b2, c1, c2, d1, d2, e1, e2, f1, f2, g1, g2, h1, h2 };
+}
+
+// Return the positions of the matches in the input buffer, or -1 for unset matches.
+std::array<ptrdiff_t, 16> StateMachine::match_offsets() {
+  std::array<ptrdiff_t, 16> offsets;
+  auto marks = save_matches();
+
+  for (size_t i = 0; i < marks.size(); i++) {
+    offsets[i] = marks[i] ? marks[i] - pb : -1;
+  }
+
+  return offsets;
+}
+
+void StateMachine::restore_matches(const std::array<const char*, 16>& marks) {
+  std::tie(a1, a2, b1, b2, c1, c2, d1, d2, e1, e2, f1, f2, g1, g2, h1, h2) = std::tuple_cat(marks);
+}
+
 bool StateMachine::is_allowed_emoji(const std::string_view name) {
-  std::string lowercase_name(name);
-  std::transform(name.begin(), name.end(), lowercase_name.begin(), &ascii_tolower);
+  if (options.emoji_list && options.emoji_list->contains(name)) {
+    return true;
+  } else if (options.emojis.empty()) {
+    return false;
+  }
+
+  // Emoji names are short, so longer names are lowercased on the heap.
+  char buffer[64];
+  std::string long_name(name.size() > sizeof(buffer) ? name.size() : 0, '\0');
+  char* lowercase_name = long_name.empty() ? buffer : long_name.data();
 
-  return options.emojis.contains(lowercase_name);
+  return options.emojis.contains({ lowercase_name, DText::ASCII::to_lower(name, lowercase_name) });
 }
 
 // True if a mention is allowed to start after this character.
@@ -1668,28 +2845,98 @@ std::tuple<std::string_view, std::string_view> StateMachine::trim_url(const std:
   return { trimmed, { trimmed.end(), url.end() } };
 }
 
-static unsigned char ascii_tolower(unsigned char c) {
-  return (c >= 'A' && c <= 'Z') ? c ^ 0x20 : c;
+// Return the length of the valid UTF-8 character at `p`, or 0 if it's invalid or cut off by `end`. Overlong forms,
+// surrogates and code points above U+10FFFF are invalid.
+static size_t utf8_char_length(const unsigned char* p, const unsigned char* end) {
+  unsigned char c = p[0];
+  ptrdiff_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+
+  if (c < 0xC2 || c > 0xF4 || end - p < length) {
+    return 0;
+  }
+
+  unsigned char min = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+  unsigned char max = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+  if (p[1] < min || p[1] > max) {
+    return 0;
+  }
+
+  for (ptrdiff_t i = 2; i < length; i++) {
+    if ((p[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+
+  return length;
 }
 
-// Replace CRLF sequences with LF.
-static void replace_newlines(const std::string_view input, std::string& output) {
-  size_t pos, last = 0;
+// Return the length of the incomplete UTF-8 character at the end of the string, or 0 if the string ends with a complete character.
+static size_t incomplete_utf8_suffix(const std::string_view string) {
+  for (size_t i = 1; i <= std::min<size_t>(3, string.size()); i++) {
+    unsigned char c = string[string.size() - i];
 
-  while (std::string::npos != (pos = input.find("\r\n", last))) {
-    output.append(input, last, pos - last);
-    output.append("\n");
-    last = pos + 2;
+    if ((c & 0xC0) != 0x80) {
+      size_t length = c >= 0xF8 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+      return length > i ? i : 0;
+    }
   }
 
-  output.append(input, last, pos - last);
+  return 0;
+}
+
+// Append the input to `output` with CRLF sequences replaced by LF. If `validate` is true, also check that the input is
+// valid UTF-8 without any null bytes, and raise DTextError (leaving `output` unchanged) if it isn't. This is done in
+// the same pass, which skips over runs of ASCII text without CRs or null bytes in bulk.
+static void append_input(const std::string_view input, std::string& output, bool validate = true) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(input.data());
+  const unsigned char* end = p + input.size();
+  const unsigned char* run = p;
+  size_t size = output.size();
+  bool null_byte = false;
+
+  while (p < end) {
+    p = reinterpret_cast<const unsigned char*>(DText::SIMD::find_first_of(reinterpret_cast<const char*>(p), input.data() + input.size(), validate ? input_special_chars : carriage_return));
+
+    if (p == end) {
+      break;
+    }
+
+    if (*p == '\r' && end - p >= 2 && p[1] == '\n') {
+      output.append(reinterpret_cast<const char*>(run), p - run);
+      run = ++p;
+    } else if (!validate || (*p != '\0' && *p < 0x80)) {
+      p++;
+    } else if (*p == '\0') {
+      null_byte = true;
+      p++;
+    } else {
+      // Check the whole run of multibyte characters before going back to looking for ASCII text.
+      do {
+        size_t length = utf8_char_length(p, end);
+
+        if (length == 0) {
+          output.resize(size);
+          throw DTextError("input contains invalid UTF-8");
+        }
+
+        p += length;
+      } while (p < end && *p >= 0x80);
+    }
+  }
+
+  output.append(reinterpret_cast<const char*>(run), end - run);
+
+  if (null_byte) {
+    output.resize(size);
+    throw DTextError("input contains null byte");
+  }
 }
 
-StateMachine::StateMachine(const auto string, int initial_state, const DTextOptions options) : options(options) {
+StateMachine::StateMachine(const auto string, int initial_state, const DTextOptions options) : options(options), domain_matcher(std::array { std::string_view(options.domain) }), internal_domain_matcher(options.internal_domains) {
   // Add null bytes to the beginning and end of the string as start and end of string markers.
   input.reserve(string.size());
   input.append(1, '\0');
-  replace_newlines(string, input);
+  append_input(string, input);
   input.append(1, '\0');
 
   output.reserve(string.size() * 1.5);
@@ -1713,24 +2960,475 @@ std::string StateMachine::parse_basic_inline(const std::string_view dtext) {
   return sm.parse();
 }
 
+// Compile a list of emoji names and register it under a name, for `DTextOptions::emoji_list`. Replaces any list already
+// registered under the name; parses that are already using the old list keep using it.
+void StateMachine::register_emoji_list(const std::string list_name, std::vector<std::string_view> emoji_names) {
+  auto list = std::make_shared<const DTextEmojiList>(emoji_names);
+
+  std::lock_guard lock(emoji_lists_mutex);
+  emoji_lists[list_name] = std::move(list);
+}
+
+// Return the emoji list registered under a name. Raises DTextError if there isn't one.
+std::shared_ptr<const DTextEmojiList> StateMachine::find_emoji_list(const std::string_view list_name) {
+  std::lock_guard lock(emoji_lists_mutex);
+  auto list = emoji_lists.find(std::string(list_name));
+
+  if (list == emoji_lists.end()) {
+    throw DTextError("unknown emoji list");
+  }
+
+  return list->second;
+}
+
+void StateMachine::clear_block_cache() {
+  block_cache.clear();
+}
+
+size_t StateMachine::block_cache_size() {
+  return block_cache.capacity();
+}
+
+// Set how many bytes of DText and HTML the block cache holds, dropping the least recently used blocks if it's over.
+void StateMachine::set_block_cache_size(size_t size) {
+  block_cache.set_capacity(size);
+}
+
 StateMachine::ParseResult StateMachine::parse_dtext(const std::string_view dtext, DTextOptions options) {
   StateMachine sm(dtext, dtext_en_main, options);
-  return { sm.parse(), sm.wiki_pages };
+
+  if (options.threads > 1 && dtext.size() >= 2 * MIN_PARALLEL_PART_SIZE) {
+    return sm.parse_parallel();
+  }
+
+  sm.digest_output = options.f_digest;
+  std::string html = sm.parse();
+
+  return { html, sm.wiki_pages, sm.digest.digest() };
+}
+
+// Parse a new version of a document, reusing the output of the previous version for the top-level blocks that haven't
+// changed. `previous_blocks` is the block index returned along with `previous_html`.
+//
+// The blocks before the first change are copied, up to the first block that the scanner had looked ahead into the
+// change from. Parsing then stops at the first block boundary after the change that lines up with a block boundary in
+// the unchanged text at the end of the previous version, and the rest of the previous output is copied from there.
+// Since the scanner is in the same state at every block boundary (see `at_block_boundary`), the result is the same as
+// parsing the whole document.
+StateMachine::IncrementalResult StateMachine::parse_incremental(const std::string_view dtext, const std::string_view previous_dtext, const std::string_view previous_html, const std::vector<DTextBlock>& previous_blocks, const DTextOptions options) {
+  StateMachine sm(dtext, dtext_en_main, options);
+  sm.record_blocks = true;
+
+  std::string previous_input(1, '\0');
+  append_input(previous_dtext, previous_input, false);
+  previous_input.append(1, '\0');
+
+  // Ignore an index that doesn't belong to the previous version. Every block must start and end its lookahead inside the
+  // previous input, so that a block before the first change resumes inside the new input too.
+  for (size_t i = 0; i < previous_blocks.size(); i++) {
+    auto& block = previous_blocks[i];
+
+    if (block.input < 2 || block.lookahead < block.input || block.lookahead >= previous_input.size() || block.output > previous_html.size() || (i > 0 && (block.input <= previous_blocks[i - 1].input || block.output < previous_blocks[i - 1].output))) {
+      return { sm.parse(), sm.blocks };
+    }
+  }
+
+  const std::string_view input = sm.input;
+  size_t prefix = std::mismatch(input.begin(), input.end(), previous_input.begin(), previous_input.end()).first - input.begin();
+  size_t suffix = std::mismatch(input.rbegin(), input.rend() - prefix, previous_input.rbegin(), previous_input.rend() - prefix).first - input.rbegin();
+  ptrdiff_t delta = input.size() - previous_input.size();
+
+  auto changed = std::find_if(previous_blocks.begin(), previous_blocks.end(), [&](auto& block) { return block.lookahead >= prefix; });
+  if (changed != previous_blocks.begin()) {
+    auto& start = changed[-1];
+
+    sm.blocks.assign(previous_blocks.begin(), changed - 1);
+    sm.output.assign(previous_html, 0, start.output);
+    sm.p = sm.pb + start.input;
+    sm.scan_max = sm.pb + start.lookahead;
+  }
+
+  // The first block whose start (and the two characters before it) is in the unchanged text at the end.
+  auto next = std::find_if(changed, previous_blocks.end(), [&](auto& block) { return block.input >= previous_input.size() - suffix + 2; });
+
+  while (sm.scan_until(next == previous_blocks.end() ? NULL : sm.pb + next->input + delta)) {
+    size_t position = sm.p - sm.pb;
+
+    if (position == next->input + delta && sm.at_block_boundary()) {
+      ptrdiff_t output_delta = sm.output.size() - next->output;
+      size_t lookahead = sm.scan_max - sm.pb;
+
+      sm.output.append(previous_html, next->output);
+      for (; next != previous_blocks.end(); next++) {
+        sm.blocks.push_back({ next->input + delta, next->output + output_delta, std::max(next->lookahead + delta, lookahead) });
+      }
+
+      sm.flush_output();
+      return { sm.output, sm.blocks };
+    }
+
+    while (next != previous_blocks.end() && next->input + delta <= position) {
+      next++;
+    }
+  }
+
+  sm.dstack_close_all();
+  sm.flush_output();
+  return { sm.output, sm.blocks };
+}
+
+// Start a machine that parses the input of `parent` from `start` to the end, as if `start` was the start of the
+// document (see `parse_parallel`).
+StateMachine::StateMachine(const StateMachine& parent, const char* start) : options(parent.options), domain_matcher(parent.domain_matcher), internal_domain_matcher(parent.internal_domain_matcher) {
+  stack.reserve(16);
+  dstack.reserve(16);
+
+  p = start;
+  pb = parent.pb;
+  pe = parent.pe;
+  eof = parent.eof;
+  cs = dtext_en_main;
+  structural_bits = parent.structural_bits;
+}
+
+// Parse the document using up to `options.threads` threads.
+//
+// The document is split after blank lines into parts of roughly equal size, and each part is parsed on its own thread
+// by a machine that starts at the beginning of the part and stops at the first token that starts in the next part. The
+// output of a part is only used if the machine for the previous part stopped exactly at the start of the part, at a
+// block boundary (see `at_block_boundary`). Otherwise, the previous machine carries on through the part itself. Either
+// way, the result is the same as parsing the whole document on one thread.
+//
+// `max_steps` and `max_output_size` apply to the whole document. Each part's machine gets an equal share of them, and if
+// it runs out, its output isn't used and the previous machine carries on through the part with what's left of the
+// limits. So a parse does at most twice the work the limits allow, however many threads it uses. If the threads can't
+// be started, the document is parsed on this thread instead.
+StateMachine::ParseResult StateMachine::parse_parallel() {
+  std::vector<const char*> splits;
+  size_t parts = std::min(options.threads, input.size() / MIN_PARALLEL_PART_SIZE);
+  std::string_view text = input;
+
+  for (size_t i = 1; i < parts; i++) {
+    size_t split = text.find("\n\n", std::max(input.size() * i / parts, splits.empty() ? 0 : size_t(splits.back() - pb)));
+    split = text.find_first_not_of('\n', split);
+
+    if (split >= text.size() - 1) {
+      break;
+    }
+
+    splits.push_back(pb + split);
+  }
+
+  const size_t max_steps = options.max_steps;
+  const size_t max_output_size = options.max_output_size;
+
+  if (options.f_structural_index) {
+    build_structural_index();
+  }
+
+  std::vector<std::unique_ptr<StateMachine>> machines;
+  for (auto split : splits) {
+    auto& machine = machines.emplace_back(std::make_unique<StateMachine>(*this, split));
+    machine->options.max_steps = max_steps ? max_steps / (splits.size() + 1) + 1 : 0;
+    machine->options.max_output_size = max_output_size ? max_output_size / (splits.size() + 1) + 1 : 0;
+  }
+
+  auto split_after = [&](size_t part) -> const char* {
+    return part < splits.size() ? splits[part] : NULL;
+  };
+
+  std::vector<std::exception_ptr> errors(machines.size());
+  std::vector<std::thread> threads;
+
+  try {
+    for (size_t i = 0; i < machines.size(); i++) {
+      threads.emplace_back([&, i] {
+        try {
+          machines[i]->scan_until(split_after(i + 1));
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      });
+    }
+  } catch (std::system_error&) {
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    digest_output = options.f_digest;
+    std::string html = parse();
+
+    return { html, wiki_pages, digest.digest() };
+  }
+
+  std::exception_ptr error;
+  try {
+    scan_until(split_after(0));
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  std::string html = take_output();
+  StateMachine* sm = this;
+  size_t total_steps = 0;
+
+  // The digest is computed over each part as it's added to the final output.
+  if (options.f_digest) {
+    digest.update(html);
+  }
+
+  for (size_t i = 0; i < machines.size(); i++) {
+    // A part that failed, whether it ran out of its share of the limits or the input is invalid, is parsed again by the
+    // previous machine, which raises the same error as parsing the whole document would if it has one.
+    if (sm->p == splits[i] && sm->at_block_boundary() && !errors[i]) {
+      total_steps += sm->steps;
+      if (sm != this) {
+        wiki_pages.merge(sm->wiki_pages);
+      }
+
+      sm = machines[i].get();
+    }
+
+    // The machine that parses the rest of the document gets what's left of the limits.
+    sm->options.max_steps = max_steps ? max_steps - total_steps : 0;
+    sm->options.max_output_size = max_output_size ? max_output_size - (html.size() - sm->output_returned) : 0;
+
+    if (sm != machines[i].get()) {
+      sm->scan_until(split_after(i + 1));
+    }
+
+    if (options.f_digest) {
+      digest.update(sm->output);
+    }
+
+    html += sm->take_output();
+  }
+
+  sm->dstack_close_all();
+  if (options.f_digest) {
+    digest.update(sm->output);
+  }
+
+  html += sm->output;
+
+  total_steps += sm->steps;
+  if (sm != this) {
+    wiki_pages.merge(sm->wiki_pages);
+  }
+
+  if (max_steps && total_steps > max_steps) {
+    throw DTextError("input too complex");
+  } else if (max_output_size && html.size() > max_output_size) {
+    throw DTextError("output too large");
+  }
+
+  return { html, wiki_pages, digest.digest() };
+}
+
+// Run the scanner until the first token that starts at or after `split`, or until the end of the input if `split` is
+// NULL. Return true if the scanner stopped at the split.
+bool StateMachine::scan_until(const char* split) {
+  split_at = split;
+
+  try {
+    scan();
+    return false;
+  } catch (SplitPoint&) {
+    return true;
+  }
+}
+
+StateMachine::StateMachine(const DTextOptions options) : options(options), domain_matcher(std::array { std::string_view(options.domain) }), internal_domain_matcher(options.internal_domains) {
+  input.append(1, '\0');
+
+  stack.reserve(16);
+  dstack.reserve(16);
+
+  p = input.c_str();
+  pb = input.c_str();
+  pe = input.c_str() + input.size();
+  cs = dtext_en_main;
+}
+
+// Parse the next chunk of input and return the HTML that has been completed so far. Text at the end of the chunk
+// that could still be part of a longer token is held back until the next call. Chunks may split multibyte characters,
+// but the input as a whole must be valid UTF-8; raises DTextError without consuming the chunk if it isn't.
+std::string StateMachine::feed(const std::string_view chunk) {
+  std::string joined;
+  std::string_view data = chunk;
+
+  if (!partial_char.empty()) {
+    joined = partial_char;
+    joined.append(chunk);
+    data = joined;
+  }
+
+  // Hold back an incomplete UTF-8 character at the end of the chunk until the rest of it arrives.
+  size_t partial = incomplete_utf8_suffix(data);
+  std::string normalized;
+  append_input(data.substr(0, data.size() - partial), normalized);
+  partial_char = data.substr(data.size() - partial);
+
+  std::string_view text = normalized;
+
+  if (text.empty()) {
+    return {};
+  }
+
+  // Hold back a trailing CR in case the next chunk starts with the LF of a CRLF sequence.
+  if (pending_cr && !text.starts_with('\n')) {
+    refill_input("\r", false);
+  }
+
+  pending_cr = text.ends_with('\r');
+  if (pending_cr) {
+    text.remove_suffix(1);
+  }
+
+  refill_input(text, false);
+  scan();
+
+  // The output of the current block is about to be returned, so it can't be added to the block cache.
+  block_start = -1;
+  return take_output();
+}
+
+// Finish parsing and return the rest of the HTML.
+std::string StateMachine::finish() {
+  if (!partial_char.empty()) {
+    throw DTextError("input contains invalid UTF-8");
+  }
+
+  refill_input(pending_cr ? "\r" : "", true);
+  pending_cr = false;
+  scan();
+
+  g_debug("EOF; closing stray blocks");
+  dstack_close_all();
+
+  return take_output();
+}
+
+// Return the output generated so far, for `feed` and `finish`, and start collecting the next part of it.
+std::string StateMachine::take_output() {
+  flush_output();
+  output_returned += output.size();
+  output_flushed = 0;
+
+  return std::exchange(output, {});
+}
+
+// Append the next chunk of input to the input buffer, discarding input that has already been parsed. Pointers into the
+// buffer are moved along with the text, except for stale matches left over from tokens that were already parsed, which
+// are emptied. The chunk has already been validated and had its CRLFs replaced (see `feed`).
+void StateMachine::refill_input(const std::string_view chunk, bool last) {
+  // Keep the token being scanned, plus two characters before it for lookbehind checks (see `after_mention_boundary`
+  // and `at_block_boundary`). Text is only discarded once it makes up most of the buffer, so each character is moved a
+  // bounded number of times.
+  size_t keep = std::max((ts ? ts : p) - pb - 2, ptrdiff_t(0));
+  size_t discard = keep > input.size() / 2 ? keep : 0;
+
+  auto offset_of = [&](const char* ptr) -> ptrdiff_t {
+    return ptr == NULL || size_t(ptr - pb) < discard ? -1 : ptr - pb - discard;
+  };
+
+  auto marks = save_matches();
+  std::array<ptrdiff_t, 16> mark_offsets;
+  for (size_t i = 0; i < marks.size(); i += 2) {
+    mark_offsets[i] = offset_of(marks[i]);
+    mark_offsets[i + 1] = offset_of(marks[i + 1]);
+
+    // If one end of a match was discarded, move it to the other end so that a stale match is empty.
+    if (marks[i] && mark_offsets[i] < 0) {
+      mark_offsets[i] = mark_offsets[i + 1];
+    } else if (marks[i + 1] && mark_offsets[i + 1] < 0) {
+      mark_offsets[i + 1] = mark_offsets[i];
+    }
+  }
+
+  std::vector<std::tuple<ptrdiff_t, ptrdiff_t, ptrdiff_t, ptrdiff_t>> attribute_offsets;
+  for (auto [name, value] : tag_attributes) {
+    if (offset_of(name.data()) >= 0 && offset_of(value.data()) >= 0) {
+      attribute_offsets.push_back({ offset_of(name.data()), name.size(), offset_of(value.data()), value.size() });
+    }
+  }
+
+  ptrdiff_t p_offset = offset_of(p), ts_offset = offset_of(ts), te_offset = offset_of(te), scan_max_offset = offset_of(scan_max), failed_lookahead_end_offset = offset_of(failed_lookahead_end);
+
+  if (discard > 0) {
+    input.erase(0, discard);
+
+    // The memoized lookaheads refer to positions in the discarded text.
+    scan_trail.clear();
+    scan_memo.clear();
+    scan_failures.clear();
+  }
+
+  input.append(chunk);
+  if (last) {
+    input.append(1, '\0');
+  }
+
+  auto pointer_at = [&](ptrdiff_t offset) -> const char* {
+    return offset < 0 ? NULL : input.c_str() + offset;
+  };
+
+  for (size_t i = 0; i < marks.size(); i++) {
+    marks[i] = pointer_at(mark_offsets[i]);
+  }
+  restore_matches(marks);
+
+  tag_attributes.clear();
+  for (auto [name, name_size, value, value_size] : attribute_offsets) {
+    tag_attributes[{ pointer_at(name), size_t(name_size) }] = { pointer_at(value), size_t(value_size) };
+  }
+
+  p = pointer_at(p_offset);
+  ts = pointer_at(ts_offset);
+  te = pointer_at(te_offset);
+  scan_max = pointer_at(scan_max_offset);
+  failed_lookahead_end = pointer_at(failed_lookahead_end_offset);
+  pb = input.c_str();
+  pe = input.c_str() + input.size();
+  eof = last ? pe : NULL;
 }
 
 std::string StateMachine::parse() {
   g_debug("parse '%.*s'", (int)(input.size() - 2), input.c_str() + 1);
 
   %% write init nocs;
-  %% write exec;
+  scan();
 
   g_debug("EOF; closing stray blocks");
   dstack_close_all();
+  flush_output();
   g_debug("done");
 
   return output;
 }
 
+// Run the scanner from `p` to the end of the input buffer.
+void StateMachine::scan() {
+  // Counting steps and recording how far each block looked ahead need to see every character.
+  scan_key_distance = options.max_steps || options.f_block_cache || record_blocks ? 0 : MIN_MEMOIZED_LOOKAHEAD;
+  scanned_p = NULL; // The scanner may resume at the start of the token it stopped at (see `feed` and `scan_until`).
+  split_blocks = options.threads > 1 || options.f_block_cache || record_blocks;
+
+  try {
+    %% write exec;
+  } catch (MoreInputNeeded&) {
+    // The scanner stopped at the start of a token, so `feed` resumes from there.
+  }
+}
+
 /* Everything below is optional, it's only needed to build bin/cdtext.exe. */
 #ifdef CDTEXT
 
@@ -2,10 +2,16 @@
 #define DTEXT_H
 
 #include "url.h"
+#include "xxh64.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -105,6 +111,143 @@ class DTextError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+// A number that's different for every compiled list of ID links, routes or emojis, so that the block cache can tell
+// them apart. Numbers are never reused, even after a list is freed.
+inline uint64_t next_list_id() {
+  static std::atomic<uint64_t> next_id = 1;
+  return next_id++;
+}
+
+// A set of ID link types, like `artist #1234` linking to `/artists/1234`, compiled once and shared by any number of
+// parses through `DTextOptions::id_links`. A type with a keyword the scanner already knows (`post`, `topic`, etc) changes
+// how those links are rendered; any other keyword adds a new type of link. `topic #123/p2` and `pixiv #123/p2` links
+// are only changed by a type with a `page`.
+class DTextIdLinks {
+public:
+  struct Type {
+    std::string keyword; // The text before the `#`, also used as the link text. Matched case-insensitively.
+    std::string name;    // The link gets the class `dtext-<name>-id-link`.
+    std::string url;     // The ID is appended to this. Relative URLs are internal links, absolute URLs are external links.
+    std::string page {}; // If set, `keyword #123/p2` links to the URL, the ID, this and the page number (e.g. `?page=`).
+  };
+
+  // A link type with its HTML prebuilt.
+  struct Link {
+    bool internal;      // If true, the URL is relative and `DTextOptions::base_url` goes in front of it.
+    bool builtin;       // If true, the scanner matches this keyword itself.
+    bool paged;         // If true, the scanner matches this keyword followed by `/p<page>` itself.
+    std::string open;   // `<a class="..." href="`
+    std::string url;    // The HTML-escaped URL.
+    std::string page;   // The HTML-escaped text between the ID and the page number, or empty if pages aren't linked.
+    std::string title;  // `">keyword #`
+  };
+
+  // A keyword followed by ` #` at the start of some text, and how far into the text the matcher had to read.
+  struct Match {
+    const Link* link;
+    size_t length;
+    size_t lookahead;
+  };
+
+  // Raises DTextError if a keyword is empty or contains anything but letters, digits, spaces, underscores and dashes.
+  explicit DTextIdLinks(const std::vector<Type>& types);
+
+  static Link compile(const Type& type);
+
+  const Link* find(const std::string_view keyword) const;
+  Match match(const std::string_view text) const;
+  uint64_t id() const { return list_id; }
+
+private:
+  // The keywords, in a trie indexed by `keyword_char_index`.
+  struct Node {
+    std::array<int32_t, 39> next;
+    int32_t link = -1;
+  };
+
+  std::vector<Link> links;
+  std::vector<Node> nodes;
+  uint64_t list_id = next_list_id();
+};
+
+// A list of internal URL paths that are shortened to ID links when they're linked to, like
+// `https://danbooru.donmai.us/artists/1234` to `artist #1234`, compiled once and shared by any number of parses through
+// `DTextOptions::routes`. They're tried before the built-in routes (`/posts/:id`, `/wiki/:id`, etc).
+class DTextRoutes {
+public:
+  struct Route {
+    std::string path;        // `artists/:id`. `:id` matches a number and a trailing `*` matches the rest of the path, if any.
+    DTextIdLinks::Type type; // The link the URL is shortened to.
+    bool query = true;       // If false, URLs with a query string aren't shortened.
+    bool fragment = true;    // If false, URLs with a fragment aren't shortened.
+  };
+
+  // Raises DTextError if a path doesn't have exactly one `:id`, or has a `*` anywhere but at the end.
+  explicit DTextRoutes(const std::vector<Route>& routes);
+
+  std::pair<const DTextIdLinks::Link*, std::string_view> match(const DText::URL& url) const;
+  uint64_t id() const { return list_id; }
+
+private:
+  struct CompiledRoute {
+    std::string path;
+    DTextIdLinks::Link link;
+    bool query;
+    bool fragment;
+  };
+
+  std::vector<CompiledRoute> routes;
+  uint64_t list_id = next_list_id();
+};
+
+// A list of emoji names, compiled into a case-insensitive perfect hash table (see `StateMachine::register_emoji_list`).
+class DTextEmojiList {
+public:
+  // Raises DTextError if a name contains anything but letters, digits and underscores.
+  explicit DTextEmojiList(const std::vector<std::string_view>& names);
+
+  bool contains(const std::string_view name) const;
+  uint64_t id() const { return list_id; }
+
+private:
+  static uint64_t hash_name(const std::string_view name);
+
+  std::vector<uint32_t> displacements; // The seed for each bucket of names.
+  std::vector<std::string> slots;      // The lowercased names, or empty strings for unused slots.
+  uint64_t list_id = next_list_id();
+};
+
+// A set of domain names, matched case-insensitively and without allocating. A name like `*.donmai.us` matches the
+// subdomains of `donmai.us` (`cdn.donmai.us`), but not `donmai.us` itself.
+class DTextDomains {
+public:
+  DTextDomains() = default;
+
+  template <typename Domains>
+  explicit DTextDomains(const Domains& domains) {
+    for (std::string_view domain : domains) {
+      add(domain);
+    }
+
+    std::sort(entries.begin(), entries.end());
+  }
+
+  bool contains(const std::string_view host) const;
+
+private:
+  struct Entry {
+    uint64_t hash;    // The hash of the name, without the `*.`.
+    bool subdomains;  // True for `*.` names.
+    std::string name; // The lowercased name, without the `*.`.
+
+    auto operator<=>(const Entry&) const = default;
+  };
+
+  void add(std::string_view domain);
+
+  std::vector<Entry> entries;
+};
+
 struct DTextOptions {
   // If false, strip block-level elements (used for displaying DText in small spaces).
   bool f_inline = false;
@@ -119,20 +262,69 @@ struct DTextOptions {
   std::string base_url;
 
   // Links to this domain are considered internal URLs, rather than external URLs (used so links to https://danbooru.donmai.us don't get marked as external).
+  // Matched case-insensitively; `*.donmai.us` matches any subdomain of donmai.us.
   std::string domain;
 
   // Links to these domains are converted to shortlinks (used so links to https://danbooru.donmai.us/posts/1234 are converted to post #1234).
+  // Matched like `domain`.
   std::unordered_set<std::string> internal_domains;
 
   // The list of emojis recognized in this piece of DText.
   std::unordered_set<std::string_view> emojis;
+
+  // If set, a list of emojis registered with `StateMachine::register_emoji_list` that are recognized too.
+  std::shared_ptr<const DTextEmojiList> emoji_list;
+
+  // If non-zero, raise an error if the HTML output grows larger than this many bytes.
+  size_t max_output_size = 0;
+
+  // If non-zero, raise an error if elements are nested deeper than this.
+  size_t max_nesting = 0;
+
+  // If non-zero, raise an error if the parser reads more than this many characters (including rescanned characters).
+  // This bounds the time spent parsing a single piece of DText.
+  size_t max_steps = 0;
+
+  // If greater than 1, split large documents at blank lines and parse the parts on up to this many threads.
+  size_t threads = 1;
+
+  // If true, reuse the HTML of top-level blocks that were already rendered with the same options, by this or an earlier
+  // parse, from a process-wide cache (used for quote-heavy forum threads and wiki page versions).
+  bool f_block_cache = false;
+
+  // If true, compute an XXH64 digest of the HTML while it's being generated (used for ETags).
+  bool f_digest = false;
+
+  // If true, find the structural bytes in the input up front with a vectorized pass over the whole input, instead of
+  // searching for the next one each time a run of plain text is skipped (see `skip_plain_text`). The output is the same
+  // either way.
+  bool f_structural_index = false;
+
+  // If set, the ID link types to recognize in addition to, or instead of, the built-in ones.
+  std::shared_ptr<const DTextIdLinks> id_links;
+
+  // If set, the internal URLs to shorten to ID links in addition to the built-in ones.
+  std::shared_ptr<const DTextRoutes> routes;
+};
+
+// A top-level block boundary in a document (see `StateMachine::parse_incremental`): the position of the block in the
+// input buffer and in the output, and how far ahead the scanner had read before reaching it. For blocks copied from a
+// previous version the lookahead may be overestimated, which only makes the next incremental parse reuse less.
+struct DTextBlock {
+  size_t input;
+  size_t output;
+  size_t lookahead;
 };
 
 class StateMachine {
 public:
   using TagAttributes = std::map<std::string_view, std::string_view>;
 
-  const DTextOptions options;
+  DTextOptions options; // Only changed by `parse_parallel`, to divide the limits between threads.
+
+  // `options.domain` and `options.internal_domains`, compiled for matching URLs against.
+  const DTextDomains domain_matcher;
+  const DTextDomains internal_domain_matcher;
 
   size_t top = 0;
   int cs;
@@ -160,6 +352,17 @@ public:
   const char * h1 = NULL;
   const char * h2 = NULL;
   bool header_mode = false;
+  bool pending_cr = false;
+  std::string partial_char; // An incomplete UTF-8 character at the end of the last chunk passed to `feed`.
+  size_t steps = 0;
+  const char* split_at = NULL;
+  const char* scan_max = NULL;
+  size_t scan_key_distance = 0; // How far a token can look ahead before the scanner calls `scan_key` again (see `next_key`).
+  const char* scanned_p = NULL; // Where `scan_key` last left the scanner, with `ts` and `cs` (see `next_key`).
+  const char* scanned_ts = NULL;
+  int scanned_cs = -1;
+  bool record_blocks = false;
+  bool split_blocks = false; // Whether the scanner stops at top-level block boundaries (see `at_token_start`).
   TagAttributes tag_attributes;
 
   std::string input;
@@ -167,13 +370,67 @@ public:
   std::vector<int> stack;
   std::vector<element_t> dstack;
   std::unordered_set<std::string> wiki_pages;
+  std::vector<DTextBlock> blocks;
+
+  // Where a lookahead that ran past its last match finally failed, plus the match positions it set along the way and
+  // the step of the lookahead that last set each of them (see `scan_key`). Positions are offsets into the input.
+  struct ScanFailure {
+    int cs;
+    ptrdiff_t p;
+    std::array<ptrdiff_t, 16> marks;
+    std::array<size_t, 16> mark_steps;
+  };
+
+  const char* failed_lookahead_end = NULL; // Where the furthest failed lookahead so far stopped.
+  std::vector<std::pair<int, ptrdiff_t>> scan_trail;
+  std::array<ptrdiff_t, 16> scan_trail_marks;
+  std::array<size_t, 16> scan_trail_mark_steps;
+  std::vector<ScanFailure> scan_failures;
+  std::unordered_map<uint64_t, std::pair<size_t, size_t>> scan_memo;
+
+  // The block being rendered for the block cache: its start in the input, its cache key, where its HTML starts in the
+  // output, and the wiki pages it links to (see `reuse_cached_block`). `block_start` is -1 if the block won't be cached.
+  // `block_options_id` is the block cache's number for the options, or 0 if it hasn't been looked up yet.
+  ptrdiff_t block_start = -1;
+  uint64_t block_key = 0;
+  size_t block_output = 0;
+  uint64_t block_options_id = 0;
+  std::vector<std::string> block_wiki_pages;
+
+  // A bitmap of the structural bytes in the input (if `f_structural_index` is set), and the run of plain text found by
+  // the last call to `skip_plain_text`: where the search started, where the plain text ends, and the next structural byte.
+  std::vector<uint64_t> structural_index;
+  const uint64_t* structural_bits = NULL;
+  const char* plain_text_start = NULL;
+  const char* plain_text_end = NULL;
+  const char* next_structural = NULL;
 
-  using ParseResult = std::tuple<std::string, decltype(wiki_pages)>;
+  // How much of the output has been checked and added to the digest, how much has already been returned by `feed`, and
+  // the digest of the output (see `flush_output`).
+  size_t output_flushed = 0;
+  size_t output_returned = 0;
+  bool digest_output = false;
+  XXH64 digest;
+
+  using ParseResult = std::tuple<std::string, decltype(wiki_pages), uint64_t>;
   static ParseResult parse_dtext(const std::string_view dtext, const DTextOptions options);
 
+  using IncrementalResult = std::tuple<std::string, std::vector<DTextBlock>>;
+  static IncrementalResult parse_incremental(const std::string_view dtext, const std::string_view previous_dtext, const std::string_view previous_html, const std::vector<DTextBlock>& previous_blocks, const DTextOptions options);
+
+  // Parse a document incrementally: pass the input to `feed` in chunks, then call `finish` at the end of the input.
+  explicit StateMachine(const DTextOptions options);
+  StateMachine(const StateMachine& parent, const char* start);
+  std::string feed(const std::string_view chunk);
+  std::string finish();
+
   std::string parse_inline(const std::string_view dtext);
   std::string parse_basic_inline(const std::string_view dtext);
-  void register_emoji_list(const std::string list_name, std::vector<std::string_view> emoji_names);
+  static void register_emoji_list(const std::string list_name, std::vector<std::string_view> emoji_names);
+  static std::shared_ptr<const DTextEmojiList> find_emoji_list(const std::string_view list_name);
+  static void clear_block_cache();
+  static size_t block_cache_size();
+  static void set_block_cache_size(size_t size);
 
   void dstack_push(element_t element);
   element_t dstack_pop();
@@ -194,11 +451,15 @@ public:
   bool dstack_close_element(element_t type, const std::string_view tag_name);
   void dstack_close_leaf_blocks();
 
+  void flush_output();
+  std::string take_output();
   void append(const auto c);
   void append(const std::string_view string);
   void append_html_escaped(char s);
   void append_html_escaped(const std::string_view string);
   void append_uri_escaped(const std::string_view string);
+  void append_normalized(const std::string_view string, char* (*normalize)(std::string_view, char*));
+  void append_uri_escaped_normalized(const std::string_view string, char* (*normalize)(std::string_view, char*));
   void append_relative_url(const auto url);
   void append_block(const auto s);
   void append_block_html_escaped(const std::string_view string);
@@ -206,6 +467,7 @@ public:
   void append_header(char header, const std::string_view id);
   void append_mention(const std::string_view name);
   void append_id_link(const char *title, const char *id_name, const char *url, const std::string_view id);
+  void append_id_link(const DTextIdLinks::Link& link, const std::string_view id);
   void append_bare_unnamed_url(const std::string_view url);
   void append_unnamed_url(const std::string_view url);
   void append_internal_url(const DText::URL &url);
@@ -215,6 +477,7 @@ public:
   void append_post_search_link(const std::string_view prefix, const std::string_view search, const std::string_view title, const std::string_view suffix);
   void append_wiki_link(const std::string_view prefix, const std::string_view tag, const std::string_view anchor, const std::string_view title, const std::string_view suffix);
   void append_paged_link(const char *title, const std::string_view id, const char *tag, const char *href, const char *param, const std::string_view page);
+  void append_paged_link(const DTextIdLinks::Link& link, const std::string_view id, const std::string_view page);
   void append_dmail_key_link(const std::string_view dmail_id, const std::string_view dmail_key);
   void append_code_fence(const std::string_view code, const std::string_view language);
   void append_inline_code(const std::string_view language = {});
@@ -223,8 +486,44 @@ public:
   void append_emoji(const std::string_view name, const std::string_view mode);
 
   void clear_matches();
+  std::string_view optional_match(const char* begin, const char* end);
+
+  void at_token_start();
+  char scan_key();
+
+  // Return the next input character for the scanner (`getkey`). Only the start of a token and lookaheads longer than
+  // `scan_key_distance` go through `scan_key`; in between, the input is read directly. In states with conditions, Ragel
+  // reads the same key again to test them, which mustn't count as another step or start the token a second time.
+  char next_key() {
+    if (size_t(p - ts - 1) < scan_key_distance || (p == scanned_p && ts == scanned_ts && cs == scanned_cs)) {
+      return *p;
+    }
+
+    char c = scan_key();
+    scanned_p = p;
+    scanned_ts = ts;
+    scanned_cs = cs;
+    return c;
+  }
+
+  bool at_block_boundary();
+  uint64_t scan_memo_key(int state, ptrdiff_t pos);
+  std::array<const char*, 16> save_matches();
+  std::array<ptrdiff_t, 16> match_offsets();
+  void restore_matches(const std::array<const char*, 16>& marks);
+  void scan_memo_invalidate(element_t element);
+  bool reuse_cached_block();
+  void build_structural_index();
+  const char* find_structural_char(const char* from);
+  void skip_plain_text();
+  void count_skipped_steps(const char* end);
+  void skip_escaped_text();
+  bool match_id_link();
+  uint64_t options_id();
+  std::string options_fingerprint();
 
   bool is_inline_element(element_t type);
+  bool is_internal_domain(const std::string_view domain);
   bool is_internal_url(const std::string_view url);
   bool is_allowed_emoji(const std::string_view name);
   std::tuple<std::string_view, std::string_view> trim_url(const std::string_view url);
@@ -232,6 +531,10 @@ public:
 private:
   StateMachine(const auto string, int initial_state, const DTextOptions = {});
   std::string parse();
+  ParseResult parse_parallel();
+  bool scan_until(const char* split);
+  void scan();
+  void refill_input(const std::string_view chunk, bool last);
 };
 
 #endif
\ No newline at end of file
@@ -9,4 +9,18 @@ if ENV["DTEXT_DEBUG"]
   $CXXFLAGS << " -g3 -fsanitize=undefined,leak -DDEBUG -D_GLIBCXX_DEBUG -D_GLIBCXX_DEBUG_PEDANTIC -D_GLIBCXX_SANITIZE_VECTOR -D_FORTIFY_SOURCE=3"
 end
 
+# Profile-guided optimization (see `rake compile:pgo`). DTEXT_PGO_GENERATE=<dir> builds an extension that writes a profile
+# to <dir> as it runs, and DTEXT_PGO_USE=<dir> builds an extension optimized with that profile.
+if ENV["DTEXT_PGO_GENERATE"]
+  $CXXFLAGS << " -fprofile-generate=#{ENV["DTEXT_PGO_GENERATE"]} -fprofile-update=atomic"
+  $LDFLAGS << " -fprofile-generate=#{ENV["DTEXT_PGO_GENERATE"]}"
+elsif ENV["DTEXT_PGO_USE"]
+  $CXXFLAGS << " -fprofile-use=#{ENV["DTEXT_PGO_USE"]} -fprofile-correction -Wno-missing-profile"
+end
+
+if ENV["DTEXT_LTO"]
+  $CXXFLAGS << " -flto=auto"
+  $LDFLAGS << " -flto=auto"
+end
+
 create_makefile "dtext/dtext"
\ No newline at end of file
@@ -1,11 +1,23 @@
 #include "dtext.h"
+#include "simd.h"
 
 #include <ruby.h>
 #include <ruby/encoding.h>
 
+#include <algorithm>
+#include <cinttypes>
+#include <memory>
+#include <utility>
+
 static VALUE cDText = Qnil;
 static VALUE cDTextError = Qnil;
+static VALUE cDTextStream = Qnil;
+static VALUE cDTextIdLinks = Qnil;
+static VALUE cDTextRoutes = Qnil;
 
+// The parser itself checks that the input is valid UTF-8 without null bytes, in the same pass that reads it into its
+// buffer, so only the string's encoding is checked here. A US-ASCII string with non-ASCII bytes isn't valid in its own
+// encoding, even if the bytes are valid UTF-8.
 static void validate_dtext(VALUE string) {
   // if input.encoding != Encoding::UTF_8 || input.encoding != Encoding::USASCII
   int encoding = rb_enc_get_index(string);
@@ -13,15 +25,10 @@ static void validate_dtext(VALUE string) {
     rb_raise(cDTextError, "input must be US-ASCII or UTF-8");
   }
 
-  // if !input.valid_encoding?
-  // https://github.com/ruby/ruby/blob/2d9812713171097eb4a3f38e49d9be39d90da2f6/string.c#L10847
-  if (rb_enc_str_coderange(string) == ENC_CODERANGE_BROKEN) {
+  // if input.encoding == Encoding::US_ASCII && !input.ascii_only?
+  if (encoding == rb_usascii_encindex() && !rb_enc_str_asciionly_p(string)) {
     rb_raise(cDTextError, "input contains invalid UTF-8");
   }
-
-  if (memchr(RSTRING_PTR(string), 0, RSTRING_LEN(string))) {
-    rb_raise(cDTextError, "input contains null byte");
-  }
 }
 
 static auto parse_dtext(VALUE input, DTextOptions options = {}) {
@@ -36,15 +43,28 @@ static auto parse_dtext(VALUE input, DTextOptions options = {}) {
   }
 }
 
-static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE emojis, VALUE f_inline, VALUE f_disable_mentions, VALUE f_media_embeds) {
-  if (NIL_P(input)) {
-    return Qnil;
-  }
-
+static DTextOptions parse_options(VALUE base_url, VALUE domain, VALUE internal_domains, VALUE emojis, VALUE f_inline, VALUE f_disable_mentions, VALUE f_media_embeds, VALUE max_output_size, VALUE max_nesting, VALUE max_steps, VALUE threads, VALUE f_block_cache, VALUE emoji_list) {
   DTextOptions options;
   options.f_inline = RTEST(f_inline);
   options.f_mentions = !RTEST(f_disable_mentions);
   options.f_media_embeds = RTEST(f_media_embeds);
+  options.f_block_cache = RTEST(f_block_cache);
+
+  if (!NIL_P(max_output_size)) {
+    options.max_output_size = NUM2SIZET(max_output_size); // raises TypeError if the limit isn't a number.
+  }
+
+  if (!NIL_P(max_nesting)) {
+    options.max_nesting = NUM2SIZET(max_nesting);
+  }
+
+  if (!NIL_P(max_steps)) {
+    options.max_steps = NUM2SIZET(max_steps);
+  }
+
+  if (!NIL_P(threads)) {
+    options.threads = NUM2SIZET(threads);
+  }
 
   if (!NIL_P(base_url)) {
     options.base_url = StringValueCStr(base_url); // base_url.to_str # raises ArgumentError if base_url contains null bytes.
@@ -70,12 +90,334 @@ static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALU
     options.emojis.insert(emoji);
   }
 
-  auto [html, _wiki_pages] = parse_dtext(input, options);
-  return rb_utf8_str_new(html.c_str(), html.size());
+  if (!NIL_P(emoji_list)) {
+    std::string_view list_name = StringValueCStr(emoji_list); // raise ArgumentError if the list name contains null bytes.
+    VALUE error = Qnil;
+
+    try {
+      options.emoji_list = StateMachine::find_emoji_list(list_name);
+    } catch (std::exception& e) {
+      error = rb_str_new_cstr(e.what());
+    }
+
+    if (!NIL_P(error)) {
+      rb_raise(cDTextError, "%" PRIsVALUE, error);
+    }
+  }
+
+  return options;
+}
+
+static VALUE c_register_emoji_list(VALUE self, VALUE list_name, VALUE emoji_names) {
+  std::string name = StringValueCStr(list_name); // raise ArgumentError if the list name contains null bytes.
+  Check_Type(emoji_names, T_ARRAY); // raises TypeError if the argument isn't an array.
+
+  std::vector<std::string_view> names;
+  for (int i = 0; i < RARRAY_LEN(emoji_names); i++) {
+    VALUE rb_emoji = rb_ary_entry(emoji_names, i);
+    names.push_back(StringValueCStr(rb_emoji)); // raise ArgumentError if the emoji name contains null bytes.
+  }
+
+  VALUE error = Qnil;
+
+  try {
+    StateMachine::register_emoji_list(name, names);
+  } catch (std::exception& e) {
+    error = rb_str_new_cstr(e.what());
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  return Qnil;
+}
+
+// Free the `std::shared_ptr` wrapped by a `DText::IdLinks` or `DText::Routes` object.
+template <typename T>
+static void shared_ptr_free(void* ptr) {
+  delete static_cast<std::shared_ptr<const T>*>(ptr);
+}
+
+template <typename T>
+static size_t shared_ptr_size(const void* ptr) {
+  return sizeof(std::shared_ptr<const T>);
+}
+
+// A set of ID link types compiled by `DText.id_links`.
+static const rb_data_type_t id_links_type = {
+  .wrap_struct_name = "DText::IdLinks",
+  .function = { .dmark = NULL, .dfree = shared_ptr_free<DTextIdLinks>, .dsize = shared_ptr_size<DTextIdLinks>, .dcompact = NULL, .reserved = {} },
+  .parent = NULL,
+  .data = NULL,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+// A list of routes compiled by `DText.routes`.
+static const rb_data_type_t routes_type = {
+  .wrap_struct_name = "DText::Routes",
+  .function = { .dmark = NULL, .dfree = shared_ptr_free<DTextRoutes>, .dsize = shared_ptr_size<DTextRoutes>, .dcompact = NULL, .reserved = {} },
+  .parent = NULL,
+  .data = NULL,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE c_id_links(VALUE self, VALUE types) {
+  Check_Type(types, T_ARRAY); // raises TypeError if the argument isn't an array.
+  std::vector<DTextIdLinks::Type> id_link_types;
+
+  for (int i = 0; i < RARRAY_LEN(types); i++) {
+    VALUE type = rb_ary_entry(types, i);
+    Check_Type(type, T_ARRAY);
+
+    VALUE keyword = rb_ary_entry(type, 0), name = rb_ary_entry(type, 1), url = rb_ary_entry(type, 2), page = rb_ary_entry(type, 3);
+    id_link_types.push_back({ StringValueCStr(keyword), StringValueCStr(name), StringValueCStr(url), NIL_P(page) ? "" : StringValueCStr(page) });
+  }
+
+  std::shared_ptr<const DTextIdLinks> id_links;
+
+  VALUE error = Qnil;
+
+  try {
+    id_links = std::make_shared<const DTextIdLinks>(id_link_types);
+  } catch (std::exception& e) {
+    error = rb_str_new_cstr(e.what());
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  return TypedData_Wrap_Struct(cDTextIdLinks, &id_links_type, new std::shared_ptr<const DTextIdLinks>(std::move(id_links)));
+}
+
+static VALUE c_routes(VALUE self, VALUE routes) {
+  Check_Type(routes, T_ARRAY); // raises TypeError if the argument isn't an array.
+  std::vector<DTextRoutes::Route> compiled_routes;
+
+  for (int i = 0; i < RARRAY_LEN(routes); i++) {
+    VALUE route = rb_ary_entry(routes, i);
+    Check_Type(route, T_ARRAY);
+
+    VALUE path = rb_ary_entry(route, 0), keyword = rb_ary_entry(route, 1), name = rb_ary_entry(route, 2), url = rb_ary_entry(route, 3);
+    compiled_routes.push_back({ StringValueCStr(path), { StringValueCStr(keyword), StringValueCStr(name), StringValueCStr(url) }, RTEST(rb_ary_entry(route, 4)), RTEST(rb_ary_entry(route, 5)) });
+  }
+
+  std::shared_ptr<const DTextRoutes> compiled;
+
+  VALUE error = Qnil;
+
+  try {
+    compiled = std::make_shared<const DTextRoutes>(compiled_routes);
+  } catch (std::exception& e) {
+    error = rb_str_new_cstr(e.what());
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  return TypedData_Wrap_Struct(cDTextRoutes, &routes_type, new std::shared_ptr<const DTextRoutes>(std::move(compiled)));
+}
+
+// Set the `DText::IdLinks` and `DText::Routes` passed to `parse` or `parse_incremental`, if any. Raises TypeError if
+// they're something else.
+static void parse_link_options(DTextOptions& options, VALUE id_links, VALUE routes) {
+  if (!NIL_P(id_links)) {
+    options.id_links = *static_cast<std::shared_ptr<const DTextIdLinks>*>(rb_check_typeddata(id_links, &id_links_type));
+  }
+
+  if (!NIL_P(routes)) {
+    options.routes = *static_cast<std::shared_ptr<const DTextRoutes>*>(rb_check_typeddata(routes, &routes_type));
+  }
+}
+
+// Takes its arguments as an array because Ruby doesn't allow methods with more than 15 arguments.
+static VALUE c_parse(int argc, VALUE* argv, VALUE self) {
+  rb_check_arity(argc, 18, 18);
+  VALUE input = argv[0], base_url = argv[1], domain = argv[2], internal_domains = argv[3], emojis = argv[4], f_inline = argv[5], f_disable_mentions = argv[6], f_media_embeds = argv[7];
+  VALUE max_output_size = argv[8], max_nesting = argv[9], max_steps = argv[10], threads = argv[11], f_block_cache = argv[12], f_digest = argv[13], f_structural_index = argv[14], id_links = argv[15];
+  VALUE routes = argv[16], emoji_list = argv[17];
+
+  if (NIL_P(input)) {
+    return Qnil;
+  }
+
+  DTextOptions options = parse_options(base_url, domain, internal_domains, emojis, f_inline, f_disable_mentions, f_media_embeds, max_output_size, max_nesting, max_steps, threads, f_block_cache, emoji_list);
+  options.f_digest = RTEST(f_digest);
+  options.f_structural_index = RTEST(f_structural_index);
+
+  parse_link_options(options, id_links, routes);
+
+  auto [html, _wiki_pages, digest] = parse_dtext(input, options);
+  VALUE rb_html = rb_utf8_str_new(html.c_str(), html.size());
+
+  if (!options.f_digest) {
+    return rb_html;
+  }
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016" PRIx64, digest);
+  return rb_ary_new_from_args(2, rb_html, rb_usascii_str_new(hex, 16));
+}
+
+// Returns the HTML, the block index, and the ID of the emoji list used (0 if none). The previous rendering is only reused
+// if it was rendered with the same emoji list, since registering a list again under the same name replaces it.
+//
+// Takes its arguments as an array because Ruby doesn't allow methods with more than 15 arguments.
+static VALUE c_parse_incremental(int argc, VALUE* argv, VALUE self) {
+  rb_check_arity(argc, 18, 18);
+  VALUE input = argv[0], previous_input = argv[1], previous_html = argv[2], previous_blocks = argv[3], previous_emoji_list_id = argv[4], base_url = argv[5], domain = argv[6], internal_domains = argv[7];
+  VALUE emojis = argv[8], f_inline = argv[9], f_disable_mentions = argv[10], f_media_embeds = argv[11], max_output_size = argv[12], max_nesting = argv[13], max_steps = argv[14], emoji_list = argv[15];
+  VALUE id_links = argv[16], routes = argv[17];
+
+  DTextOptions options = parse_options(base_url, domain, internal_domains, emojis, f_inline, f_disable_mentions, f_media_embeds, max_output_size, max_nesting, max_steps, Qnil, Qfalse, emoji_list);
+  parse_link_options(options, id_links, routes);
+
+  uint64_t emoji_list_id = options.emoji_list ? options.emoji_list->id() : 0;
+  std::string_view previous_dtext, previous_output;
+  std::vector<DTextBlock> blocks;
+
+  if (!NIL_P(previous_input) && NUM2ULL(previous_emoji_list_id) == emoji_list_id) {
+    previous_dtext = { RSTRING_PTR(StringValue(previous_input)), (size_t)RSTRING_LEN(previous_input) };
+    previous_output = { RSTRING_PTR(StringValue(previous_html)), (size_t)RSTRING_LEN(previous_html) };
+    Check_Type(previous_blocks, T_ARRAY); // raises TypeError if the argument isn't an array.
+
+    for (int i = 0; i + 2 < RARRAY_LEN(previous_blocks); i += 3) {
+      blocks.push_back({
+        NUM2SIZET(rb_ary_entry(previous_blocks, i)),
+        NUM2SIZET(rb_ary_entry(previous_blocks, i + 1)),
+        NUM2SIZET(rb_ary_entry(previous_blocks, i + 2)),
+      });
+    }
+  }
+
+  StringValue(input);
+  validate_dtext(input);
+
+  // Only the parse happens inside the `try`. Ruby objects are built, and errors raised, outside of it, since a Ruby
+  // exception would jump out of the `try` without unwinding it.
+  StateMachine::IncrementalResult result;
+  VALUE error = Qnil;
+
+  try {
+    std::string_view dtext(RSTRING_PTR(input), RSTRING_LEN(input));
+    result = StateMachine::parse_incremental(dtext, previous_dtext, previous_output, blocks, options);
+  } catch (std::exception& e) {
+    error = rb_str_new_cstr(e.what());
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  auto& [html, new_blocks] = result;
+  VALUE rb_blocks = rb_ary_new_capa(new_blocks.size() * 3);
+  for (auto block : new_blocks) {
+    rb_ary_push(rb_blocks, SIZET2NUM(block.input));
+    rb_ary_push(rb_blocks, SIZET2NUM(block.output));
+    rb_ary_push(rb_blocks, SIZET2NUM(block.lookahead));
+  }
+
+  return rb_ary_new_from_args(3, rb_utf8_str_new(html.c_str(), html.size()), rb_blocks, ULL2NUM(emoji_list_id));
+}
+
+// An incremental parse started by `DText.stream`. The emoji names are copied because the options outlive the call that
+// created the stream.
+struct DTextStream {
+  std::vector<std::string> emojis;
+  std::unique_ptr<StateMachine> sm;
+};
+
+static void stream_free(void* ptr) {
+  delete static_cast<DTextStream*>(ptr);
+}
+
+static size_t stream_size(const void* ptr) {
+  return sizeof(DTextStream);
+}
+
+static const rb_data_type_t stream_type = {
+  .wrap_struct_name = "DText::Stream",
+  .function = { .dmark = NULL, .dfree = stream_free, .dsize = stream_size, .dcompact = NULL, .reserved = {} },
+  .parent = NULL,
+  .data = NULL,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE c_stream(VALUE self, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE emojis, VALUE f_inline, VALUE f_disable_mentions, VALUE f_media_embeds, VALUE max_output_size, VALUE max_nesting, VALUE max_steps, VALUE emoji_list, VALUE id_links, VALUE routes) {
+  DTextOptions options = parse_options(base_url, domain, internal_domains, emojis, f_inline, f_disable_mentions, f_media_embeds, max_output_size, max_nesting, max_steps, Qnil, Qfalse, emoji_list);
+  parse_link_options(options, id_links, routes);
+
+  DTextStream* stream = new DTextStream();
+  stream->emojis.assign(options.emojis.begin(), options.emojis.end());
+  options.emojis = std::unordered_set<std::string_view>(stream->emojis.begin(), stream->emojis.end());
+  stream->sm = std::make_unique<StateMachine>(options);
+
+  return TypedData_Wrap_Struct(cDTextStream, &stream_type, stream);
+}
+
+// Feed the next chunk of input to the stream and return the HTML completed so far. Chunks may be binary strings and may
+// split multibyte characters; the input as a whole must be valid UTF-8.
+static VALUE c_stream_feed(VALUE self, VALUE chunk) {
+  DTextStream* stream;
+  TypedData_Get_Struct(self, DTextStream, &stream_type, stream);
+
+  StringValue(chunk);
+  int encoding = rb_enc_get_index(chunk);
+  if (encoding != rb_usascii_encindex() && encoding != rb_utf8_encindex() && encoding != rb_ascii8bit_encindex()) {
+    rb_raise(cDTextError, "input must be US-ASCII or UTF-8");
+  } else if (!stream->sm) {
+    rb_raise(cDTextError, "stream is already finished");
+  }
+
+  VALUE html = Qnil, error = Qnil;
+
+  try {
+    std::string result = stream->sm->feed({ RSTRING_PTR(chunk), size_t(RSTRING_LEN(chunk)) });
+    html = rb_utf8_str_new(result.data(), result.size());
+  } catch (std::exception& e) {
+    error = rb_str_new_cstr(e.what());
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  return html;
+}
+
+// Finish the stream and return the rest of the HTML.
+static VALUE c_stream_finish(VALUE self) {
+  DTextStream* stream;
+  TypedData_Get_Struct(self, DTextStream, &stream_type, stream);
+
+  if (!stream->sm) {
+    rb_raise(cDTextError, "stream is already finished");
+  }
+
+  VALUE html = Qnil, error = Qnil;
+
+  {
+    auto sm = std::move(stream->sm);
+
+    try {
+      std::string result = sm->finish();
+      html = rb_utf8_str_new(result.data(), result.size());
+    } catch (std::exception& e) {
+      error = rb_str_new_cstr(e.what());
+    }
+  }
+
+  if (!NIL_P(error)) {
+    rb_raise(cDTextError, "%" PRIsVALUE, error);
+  }
+
+  return html;
 }
 
 static VALUE c_parse_wiki_pages(VALUE self, VALUE input) {
-  auto [_html, wiki_pages] = parse_dtext(input);
+  auto [_html, wiki_pages, _digest] = parse_dtext(input);
 
   VALUE rb_wiki_pages = rb_ary_new_capa(wiki_pages.size());
   for (auto wiki_page : wiki_pages) {
@@ -86,9 +428,61 @@ static VALUE c_parse_wiki_pages(VALUE self, VALUE input) {
   return rb_wiki_pages;
 }
 
+static VALUE c_clear_block_cache(VALUE self) {
+  StateMachine::clear_block_cache();
+  return Qnil;
+}
+
+static VALUE c_block_cache_size(VALUE self) {
+  return SIZET2NUM(StateMachine::block_cache_size());
+}
+
+static VALUE c_set_block_cache_size(VALUE self, VALUE size) {
+  StateMachine::set_block_cache_size(NUM2SIZET(size)); // raises TypeError if the size isn't a number.
+  return size;
+}
+
+static VALUE c_simd_level(VALUE self) {
+  auto name = DText::SIMD::level_name(DText::SIMD::level());
+  return rb_str_new(name.data(), name.size());
+}
+
+static VALUE c_simd_levels(VALUE self) {
+  auto levels = DText::SIMD::supported_levels();
+
+  VALUE rb_levels = rb_ary_new_capa(levels.size());
+  for (auto level : levels) {
+    auto name = DText::SIMD::level_name(level);
+    rb_ary_push(rb_levels, rb_str_new(name.data(), name.size()));
+  }
+
+  return rb_levels;
+}
+
 extern "C" void Init_dtext() {
   cDText = rb_define_class("DText", rb_cObject);
   cDTextError = rb_define_class_under(cDText, "Error", rb_eStandardError);
-  rb_define_singleton_method(cDText, "c_parse", c_parse, 8);
+  rb_define_singleton_method(cDText, "c_parse", c_parse, -1);
   rb_define_singleton_method(cDText, "c_parse_wiki_pages", c_parse_wiki_pages, 1);
+  rb_define_singleton_method(cDText, "c_parse_incremental", c_parse_incremental, -1);
+  rb_define_singleton_method(cDText, "c_stream", c_stream, 13);
+  rb_define_singleton_method(cDText, "c_register_emoji_list", c_register_emoji_list, 2);
+  rb_define_singleton_method(cDText, "c_id_links", c_id_links, 1);
+  rb_define_singleton_method(cDText, "c_routes", c_routes, 1);
+  rb_define_singleton_method(cDText, "c_clear_block_cache", c_clear_block_cache, 0);
+  rb_define_singleton_method(cDText, "c_block_cache_size", c_block_cache_size, 0);
+  rb_define_singleton_method(cDText, "c_set_block_cache_size", c_set_block_cache_size, 1);
+  rb_define_singleton_method(cDText, "c_simd_level", c_simd_level, 0);
+  rb_define_singleton_method(cDText, "c_simd_levels", c_simd_levels, 0);
+
+  cDTextStream = rb_define_class_under(cDText, "Stream", rb_cObject);
+  rb_undef_alloc_func(cDTextStream);
+  rb_define_method(cDTextStream, "feed", c_stream_feed, 1);
+  rb_define_method(cDTextStream, "finish", c_stream_finish, 0);
+
+  cDTextIdLinks = rb_define_class_under(cDText, "IdLinks", rb_cObject);
+  rb_undef_alloc_func(cDTextIdLinks);
+
+  cDTextRoutes = rb_define_class_under(cDText, "Routes", rb_cObject);
+  rb_undef_alloc_func(cDTextRoutes);
 }
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DTEXT_X86 1
+#include <immintrin.h>
+#endif
+
+namespace DText::SIMD {
+
+static const char* find_first_of_scalar(const char* p, const char* end, const ByteSet& set) {
+  while (p < end && !set.contains(*p)) {
+    p++;
+  }
+
+  return p;
+}
+
+static void build_bitmap_scalar(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap) {
+  for (size_t i = 0; i < size; i++) {
+    bitmap[i / 64] |= uint64_t(set.contains(p[i])) << (i % 64);
+  }
+}
+
+#ifdef DTEXT_X86
+
+// The SSE2 version checks 16 bytes at a time. SSE2 has no byte shuffle to look the bytes up in the nibble tables with,
+// so the bytes in the set are broadcast to vectors once per call and compared one at a time.
+struct SSE2Needles {
+  __attribute__((target("sse2"))) explicit SSE2Needles(const ByteSet& set) : size(set.size), high_bit(set.high_bit) {
+    for (size_t i = 0; i < size; i++) {
+      needles[i] = _mm_set1_epi8(set.bytes[i]);
+    }
+  }
+
+  __attribute__((target("sse2"))) unsigned match(const char* p) const {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i matches = high_bit ? chunk : _mm_setzero_si128();
+
+    for (size_t i = 0; i < size; i++) {
+      matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, needles[i]));
+    }
+
+    return _mm_movemask_epi8(matches);
+  }
+
+  __m128i needles[16];
+  size_t size;
+  bool high_bit;
+};
+
+__attribute__((target("sse2"))) static const char* find_first_of_sse2(const char* p, const char* end, const ByteSet& set) {
+  SSE2Needles needles(set);
+
+  for (; end - p >= 16; p += 16) {
+    if (unsigned mask = needles.match(p)) {
+      return p + std::countr_zero(mask);
+    }
+  }
+
+  return find_first_of_scalar(p, end, set);
+}
+
+__attribute__((target("sse2"))) static void build_bitmap_sse2(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap) {
+  SSE2Needles needles(set);
+  size_t i = 0;
+
+  for (; i + 64 <= size; i += 64) {
+    bitmap[i / 64] = uint64_t(needles.match(p + i)) | uint64_t(needles.match(p + i + 16)) << 16 |
+                     uint64_t(needles.match(p + i + 32)) << 32 | uint64_t(needles.match(p + i + 48)) << 48;
+  }
+
+  build_bitmap_scalar(p + i, size - i, set, bitmap + i / 64);
+}
+
+// The AVX2 and AVX-512 versions look each byte's nibbles up in the set's nibble tables with a shuffle (see `ByteSet`),
+// which takes the same few instructions however many bytes are in the set. The tables only have to be loaded.
+__attribute__((target("avx2"))) static uint32_t match_nibbles(__m128i chunk, __m128i low_nibbles, __m128i high_nibbles, bool high_bit) {
+  __m128i low = _mm_and_si128(chunk, _mm_set1_epi8(0x0F));
+  __m128i high = _mm_and_si128(_mm_srli_epi16(chunk, 4), _mm_set1_epi8(0x0F));
+  __m128i bits = _mm_and_si128(_mm_shuffle_epi8(low_nibbles, low), _mm_shuffle_epi8(high_nibbles, high));
+  uint32_t mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) & 0xFFFF;
+
+  return high_bit ? mask | _mm_movemask_epi8(chunk) : mask;
+}
+
+__attribute__((target("avx2"))) static uint32_t match_nibbles(__m256i chunk, __m256i low_nibbles, __m256i high_nibbles, bool high_bit) {
+  __m256i low = _mm256_and_si256(chunk, _mm256_set1_epi8(0x0F));
+  __m256i high = _mm256_and_si256(_mm256_srli_epi16(chunk, 4), _mm256_set1_epi8(0x0F));
+  __m256i bits = _mm256_and_si256(_mm256_shuffle_epi8(low_nibbles, low), _mm256_shuffle_epi8(high_nibbles, high));
+  uint32_t mask = ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, _mm256_setzero_si256())));
+
+  return high_bit ? mask | _mm256_movemask_epi8(chunk) : mask;
+}
+
+// The AVX2 version checks 32 bytes at a time, then 16, then one at a time.
+__attribute__((target("avx2"))) static const char* find_first_of_avx2(const char* p, const char* end, const ByteSet& set) {
+  __m128i low_nibbles = _mm_load_si128(reinterpret_cast<const __m128i*>(set.low_nibbles.data()));
+  __m128i high_nibbles = _mm_load_si128(reinterpret_cast<const __m128i*>(set.high_nibbles.data()));
+  __m256i low_nibbles256 = _mm256_broadcastsi128_si256(low_nibbles);
+  __m256i high_nibbles256 = _mm256_broadcastsi128_si256(high_nibbles);
+
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+    if (uint32_t mask = match_nibbles(chunk, low_nibbles256, high_nibbles256, set.high_bit)) {
+      return p + std::countr_zero(mask);
+    }
+  }
+
+  if (end - p >= 16) {
+    if (uint32_t mask = match_nibbles(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), low_nibbles, high_nibbles, set.high_bit)) {
+      return p + std::countr_zero(mask);
+    }
+
+    p += 16;
+  }
+
+  return find_first_of_scalar(p, end, set);
+}
+
+__attribute__((target("avx2"))) static void build_bitmap_avx2(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap) {
+  __m256i low_nibbles = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(set.low_nibbles.data())));
+  __m256i high_nibbles = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(set.high_nibbles.data())));
+  size_t i = 0;
+
+  for (; i + 64 <= size; i += 64) {
+    __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 32));
+    bitmap[i / 64] = uint64_t(match_nibbles(first, low_nibbles, high_nibbles, set.high_bit)) |
+                     uint64_t(match_nibbles(second, low_nibbles, high_nibbles, set.high_bit)) << 32;
+  }
+
+  build_bitmap_scalar(p + i, size - i, set, bitmap + i / 64);
+}
+
+// The AVX-512 version checks 64 bytes at a time, including the last few bytes of the string, which are read with a
+// masked load so nothing past the end is touched.
+struct AVX512NibbleTables {
+  __attribute__((target("avx512f,avx512bw"))) explicit AVX512NibbleTables(const ByteSet& set) : high_bit(set.high_bit) {
+    low_nibbles = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128(reinterpret_cast<const __m128i*>(set.low_nibbles.data())));
+    high_nibbles = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128(reinterpret_cast<const __m128i*>(set.high_nibbles.data())));
+  }
+
+  __attribute__((target("avx512f,avx512bw"))) uint64_t match(__m512i chunk) const {
+    __m512i low = _mm512_and_si512(chunk, _mm512_set1_epi8(0x0F));
+    __m512i high = _mm512_and_si512(_mm512_srli_epi16(chunk, 4), _mm512_set1_epi8(0x0F));
+    __m512i bits = _mm512_and_si512(_mm512_shuffle_epi8(low_nibbles, low), _mm512_shuffle_epi8(high_nibbles, high));
+    uint64_t mask = _mm512_test_epi8_mask(bits, bits);
+
+    return high_bit ? mask | _mm512_movepi8_mask(chunk) : mask;
+  }
+
+  __attribute__((target("avx512f,avx512bw"))) uint64_t match(const char* p) const {
+    return match(_mm512_loadu_si512(p));
+  }
+
+  // Match the first `n` bytes at `p`, for n < 64.
+  __attribute__((target("avx512f,avx512bw"))) uint64_t match(const char* p, size_t n) const {
+    uint64_t valid = (uint64_t(1) << n) - 1;
+    return match(_mm512_maskz_loadu_epi8(valid, p)) & valid;
+  }
+
+  __m512i low_nibbles;
+  __m512i high_nibbles;
+  bool high_bit;
+};
+
+__attribute__((target("avx512f,avx512bw"))) static const char* find_first_of_avx512(const char* p, const char* end, const ByteSet& set) {
+  AVX512NibbleTables tables(set);
+
+  for (; end - p >= 64; p += 64) {
+    if (uint64_t mask = tables.match(p)) {
+      return p + std::countr_zero(mask);
+    }
+  }
+
+  if (p < end) {
+    if (uint64_t mask = tables.match(p, end - p)) {
+      return p + std::countr_zero(mask);
+    }
+  }
+
+  return end;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void build_bitmap_avx512(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap) {
+  AVX512NibbleTables tables(set);
+  size_t i = 0;
+
+  for (; i + 64 <= size; i += 64) {
+    bitmap[i / 64] = tables.match(p + i);
+  }
+
+  if (i < size) {
+    bitmap[i / 64] |= tables.match(p + i, size - i);
+  }
+}
+
+#endif
+
+struct Kernels {
+  Level level;
+  const char* (*find_first_of)(const char* p, const char* end, const ByteSet& set);
+  void (*build_bitmap)(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap);
+};
+
+static Kernels kernels_for(Level level) {
+  switch (level) {
+#ifdef DTEXT_X86
+    case Level::AVX512: return { level, find_first_of_avx512, build_bitmap_avx512 };
+    case Level::AVX2: return { level, find_first_of_avx2, build_bitmap_avx2 };
+    case Level::SSE2: return { level, find_first_of_sse2, build_bitmap_sse2 };
+#endif
+    default: return { Level::Scalar, find_first_of_scalar, build_bitmap_scalar };
+  }
+}
+
+static Level max_supported_level() {
+#ifdef DTEXT_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return Level::AVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    return Level::AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return Level::SSE2;
+  }
+#endif
+
+  return Level::Scalar;
+}
+
+// The highest level supported by the CPU, or the level given by `DTEXT_SIMD` if it's lower.
+static Level initial_level() {
+  Level max_level = max_supported_level();
+  const char* name = std::getenv("DTEXT_SIMD");
+
+  for (Level level : { Level::Scalar, Level::SSE2, Level::AVX2, Level::AVX512 }) {
+    if (name && level_name(level) == name) {
+      return std::min(level, max_level);
+    }
+  }
+
+  return max_level;
+}
+
+static const Kernels kernels = kernels_for(initial_level());
+
+const char* find_first_of(const char* p, const char* end, const ByteSet& set) {
+  return kernels.find_first_of(p, end, set);
+}
+
+void build_bitmap(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap) {
+  kernels.build_bitmap(p, size, set, bitmap);
+}
+
+Level level() {
+  return kernels.level;
+}
+
+std::vector<Level> supported_levels() {
+  std::vector<Level> levels;
+
+  for (Level level : { Level::Scalar, Level::SSE2, Level::AVX2, Level::AVX512 }) {
+    if (level <= max_supported_level()) {
+      levels.push_back(level);
+    }
+  }
+
+  return levels;
+}
+
+std::string_view level_name(Level level) {
+  switch (level) {
+    case Level::Scalar: return "scalar";
+    case Level::SSE2: return "sse2";
+    case Level::AVX2: return "avx2";
+    case Level::AVX512: return "avx512";
+  }
+
+  return "";
+}
+
+}
@@ -0,0 +1,76 @@
+#ifndef DTEXT_SIMD_H
+#define DTEXT_SIMD_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Kernels for searching the input for sets of bytes. Each kernel has a scalar, SSE2, AVX2 and AVX-512 version, and the
+// best version the CPU supports is picked once when the library is loaded. The `DTEXT_SIMD` environment variable can
+// be set to `scalar`, `sse2`, `avx2` or `avx512` to use a lower level instead (`DTEXT_SIMD=scalar` turns SIMD off).
+namespace DText::SIMD {
+
+enum class Level { Scalar, SSE2, AVX2, AVX512 };
+
+// A set of up to 16 ASCII bytes, plus optionally every byte with the high bit set (the bytes of non-ASCII UTF-8
+// characters).
+//
+// The sets are built at compile time, along with the nibble tables the AVX2 and AVX-512 kernels look bytes up in, so
+// a search doesn't have to set anything up first. A byte is in the set if the bits for its low and high nibbles overlap:
+// `low_nibbles[c & 15]` has bit `n` set for each byte in the set with a high nibble of `n`, and `high_nibbles[n]` is
+// `1 << n` for the high nibbles of ASCII bytes and 0 for the rest.
+class ByteSet {
+ public:
+  constexpr ByteSet(std::string_view bytes, bool high_bit = false) : size(bytes.size()), high_bit(high_bit) {
+    for (size_t i = 0; i < bytes.size(); i++) {
+      unsigned char c = bytes[i];
+
+      if (c >= 0x80) {
+        throw "ByteSet bytes must be ASCII"; // A compile error, since the sets are constexpr.
+      }
+
+      this->bytes[i] = c;
+      table[c] = true;
+      low_nibbles[c & 15] |= 1 << (c >> 4);
+    }
+
+    for (int c = 0x80; high_bit && c < 0x100; c++) {
+      table[c] = true;
+    }
+
+    for (int n = 0; n < 8; n++) {
+      high_nibbles[n] = 1 << n;
+    }
+  }
+
+  constexpr bool contains(unsigned char c) const { return table[c]; }
+
+  std::array<char, 16> bytes = {};
+  size_t size;
+  bool high_bit;
+  std::array<bool, 256> table = {};
+  alignas(16) std::array<uint8_t, 16> low_nibbles = {};
+  alignas(16) std::array<uint8_t, 16> high_nibbles = {};
+};
+
+// Return the first byte in the string that's in the set, or the end of the string if there isn't one.
+const char* find_first_of(const char* p, const char* end, const ByteSet& set);
+
+// Set bit `i % 64` of `bitmap[i / 64]` for each byte `p[i]` that's in the set. The bitmap must have room for
+// `size / 64 + 1` words, and be zeroed beforehand.
+void build_bitmap(const char* p, size_t size, const ByteSet& set, uint64_t* bitmap);
+
+// The level of the kernels in use.
+Level level();
+
+// The levels supported by this CPU, from lowest to highest.
+std::vector<Level> supported_levels();
+
+// The name of the level (`scalar`, `sse2`, `avx2` or `avx512`).
+std::string_view level_name(Level level);
+
+}
+
+#endif
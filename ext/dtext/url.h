@@ -1,12 +1,58 @@
 #ifndef DTEXT_URL_H
 #define DTEXT_URL_H
 
-#include <string>
-#include <regex>
-#include <vector>
+#include <algorithm>
+#include <string_view>
 
 namespace DText {
 
+// Return the next non-empty segment of a path and remove it from the path.
+inline std::string_view next_path_segment(std::string_view& path) {
+  while (path.starts_with('/')) {
+    path.remove_prefix(1);
+  }
+
+  std::string_view segment = path.substr(0, path.find('/'));
+  path.remove_prefix(segment.size());
+  return segment;
+}
+
+// The non-empty segments of a path (`posts` and `1234` in `posts//1234/`), without allocating.
+class PathSegments {
+ public:
+  class iterator {
+   public:
+    explicit iterator(std::string_view path) : rest(path) {
+      ++*this;
+    }
+
+    std::string_view operator*() const { return segment; }
+    bool operator==(const iterator& other) const { return segment.data() == other.segment.data() && segment.size() == other.segment.size(); }
+
+    iterator& operator++() {
+      segment = next_path_segment(rest);
+
+      if (segment.empty()) {
+        segment = {};
+      }
+
+      return *this;
+    }
+
+   private:
+    std::string_view rest;
+    std::string_view segment;
+  };
+
+  explicit PathSegments(std::string_view path) : path(path) {}
+
+  iterator begin() const { return iterator(path); }
+  iterator end() const { return iterator({}); }
+
+ private:
+  std::string_view path;
+};
+
 class URL {
  public:
   const std::string_view url;
@@ -20,37 +66,98 @@ class URL {
     parse();
   }
 
-  const std::vector<std::string_view> path_components() const {
-    std::vector<std::string_view> output;
+  PathSegments path_segments() const {
+    return PathSegments(path);
+  }
+
+ private:
 
-    for (size_t previous = 0, current = 0; current != std::string_view::npos; previous = current + 1) {
-      current = path.find_first_of('/', previous);
+  // https://danbooru.donmai.us:443/posts/1234?q=touhou#comment-1234
+  //
+  // Splits the URL in one pass the same way as this regex, leaving every part empty if the URL doesn't match:
+  //
+  //   /^([a-z]+):(?:\/\/)?([^\/?#:]+)(:[0-9]+)?(?:\/([^?#]*))?(?:\?([^#]*))?(?:#(.*))?$/i
+  void parse() {
+    auto is_alpha = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); };
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+
+    size_t i = 0;
+    size_t n = url.size();
 
-      if (current > previous) {
-        output.push_back(path.substr(previous, current - previous));
+    while (i < n && is_alpha(url[i])) {
+      i++;
+    }
+
+    if (i == 0 || i == n || url[i] != ':') {
+      return;
+    }
+
+    size_t scheme_end = i++;
+
+    if (url.substr(i, 2) == "//") {
+      i += 2;
+    }
+
+    size_t domain_start = i;
+    while (i < n && url[i] != '/' && url[i] != '?' && url[i] != '#' && url[i] != ':') {
+      i++;
+    }
+
+    size_t domain_end = i;
+    if (domain_end == domain_start) {
+      return;
+    }
+
+    if (i < n && url[i] == ':') {
+      size_t port_start = ++i;
+
+      while (i < n && is_digit(url[i])) {
+        i++;
+      }
+
+      if (i == port_start) {
+        return;
       }
     }
 
-    return output;
-  }
+    size_t path_start = i, path_end = i;
+    if (i < n && url[i] == '/') {
+      path_start = ++i;
+      i = std::min(url.find_first_of("?#", i), n);
+      path_end = i;
+    }
 
- private:
+    size_t query_start = i, query_end = i;
+    if (i < n && url[i] == '?') {
+      query_start = ++i;
+      i = std::min(url.find('#', i), n);
+      query_end = i;
+    }
 
-  void parse() {
-    // https://danbooru.donmai.us:443/posts/1234?q=touhou#comment-1234
-    static const std::regex url_regex("^([a-z]+):(?://)?([^/?#:]+)(:[0-9]+)?(?:/([^?#]*))?(?:\\?([^#]*))?(?:#(.*))?$", std::regex_constants::icase | std::regex_constants::optimize);
-    std::match_results<std::string_view::const_iterator> matches;
-
-    if (std::regex_search(url.begin(), url.end(), matches, url_regex)) {
-      scheme = { matches[1].first, matches[1].second };
-      domain = { matches[2].first, matches[2].second };
-      path = { matches[4].first, matches[4].second };
-      query = { matches[5].first, matches[5].second };
-      fragment = { matches[6].first, matches[6].second };
-    };
+    size_t fragment_start = i;
+    if (i < n && url[i] == '#') {
+      fragment_start = ++i;
+
+      // `.` doesn't match line terminators.
+      if (url.find_first_of("\r\n", i) != std::string_view::npos) {
+        return;
+      }
+
+      i = n;
+    }
+
+    if (i != n) {
+      return;
+    }
+
+    scheme = url.substr(0, scheme_end);
+    domain = url.substr(domain_start, domain_end - domain_start);
+    path = url.substr(path_start, path_end - path_start);
+    query = url.substr(query_start, query_end - query_start);
+    fragment = url.substr(fragment_start, n - fragment_start);
   }
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
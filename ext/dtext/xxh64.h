@@ -0,0 +1,130 @@
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// An incremental implementation of the XXH64 hash function (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md),
+// used for computing a digest of the HTML as it's generated. Gives the same result as hashing the whole string at once.
+class XXH64 {
+public:
+  explicit XXH64(uint64_t seed = 0) : seed(seed) {
+    lanes[0] = seed + PRIME1 + PRIME2;
+    lanes[1] = seed + PRIME2;
+    lanes[2] = seed;
+    lanes[3] = seed - PRIME1;
+  }
+
+  void update(std::string_view data) {
+    total_length += data.size();
+
+    if (buffer_size + data.size() < sizeof(buffer)) {
+      memcpy(buffer + buffer_size, data.data(), data.size());
+      buffer_size += data.size();
+      return;
+    }
+
+    if (buffer_size > 0) {
+      size_t fill = sizeof(buffer) - buffer_size;
+      memcpy(buffer + buffer_size, data.data(), fill);
+      consume_stripe(buffer);
+      data.remove_prefix(fill);
+      buffer_size = 0;
+    }
+
+    while (data.size() >= sizeof(buffer)) {
+      consume_stripe(data.data());
+      data.remove_prefix(sizeof(buffer));
+    }
+
+    memcpy(buffer, data.data(), data.size());
+    buffer_size = data.size();
+  }
+
+  uint64_t digest() const {
+    uint64_t hash;
+
+    if (total_length >= sizeof(buffer)) {
+      hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+
+      for (uint64_t lane : lanes) {
+        hash = (hash ^ round(0, lane)) * PRIME1 + PRIME4;
+      }
+    } else {
+      hash = seed + PRIME5;
+    }
+
+    hash += total_length;
+
+    const char* p = buffer;
+    const char* end = buffer + buffer_size;
+
+    for (; p + 8 <= end; p += 8) {
+      hash = rotl(hash ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    }
+
+    if (p + 4 <= end) {
+      hash = rotl(hash ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+      p += 4;
+    }
+
+    for (; p < end; p++) {
+      hash = rotl(hash ^ (uint8_t(*p) * PRIME5), 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+  }
+
+private:
+  static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+  static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static uint64_t round(uint64_t lane, uint64_t input) {
+    return rotl(lane + input * PRIME2, 31) * PRIME1;
+  }
+
+  // XXH64 is defined on little-endian words.
+  static uint64_t read64(const char* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+      value = (value << 8) | uint8_t(p[i]);
+    }
+    return value;
+  }
+
+  static uint64_t read32(const char* p) {
+    uint64_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+      value = (value << 8) | uint8_t(p[i]);
+    }
+    return value;
+  }
+
+  void consume_stripe(const char* p) {
+    for (int i = 0; i < 4; i++) {
+      lanes[i] = round(lanes[i], read64(p + 8 * i));
+    }
+  }
+
+  uint64_t seed;
+  uint64_t lanes[4];
+  uint64_t total_length = 0;
+  char buffer[32];
+  size_t buffer_size = 0;
+};
+
+#endif
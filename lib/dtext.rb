@@ -17,7 +17,88 @@ end
 class DText
   class Error < StandardError; end
 
-  def self.parse(str, inline: false, media_embeds: true, disable_mentions: false, base_url: nil, domain: nil, internal_domains: [], emojis: [])
-    c_parse(str, base_url, domain, internal_domains, emojis, inline, disable_mentions, media_embeds)
+  # Convert DText to HTML. With `digest: true`, returns `[html, digest]` instead, where `digest` is the XXH64 hash of the
+  # HTML as a hex string, computed while the HTML is generated (for use as an ETag). With `structural_index: true`, the
+  # bytes where plain text ends are found with a vectorized pre-pass over the whole input, instead of as the plain text is
+  # skipped; the output is the same.
+  # `id_links` is a set of extra ID link types returned by `DText.id_links`, and `routes` is a list of extra internal URLs
+  # to shorten returned by `DText.routes`. `emoji_list` is the name of a list of emojis registered with
+  # `DText.register_emoji_list`, recognized along with `emojis`.
+  def self.parse(str, inline: false, media_embeds: true, disable_mentions: false, base_url: nil, domain: nil, internal_domains: [], emojis: [], emoji_list: nil, max_output_size: nil, max_nesting: nil, max_steps: nil, threads: nil, block_cache: false, digest: false, structural_index: false, id_links: nil, routes: nil)
+    c_parse(str, base_url, domain, internal_domains, emojis, inline, disable_mentions, media_embeds, max_output_size, max_nesting, max_steps, threads, block_cache, digest, structural_index, id_links, routes, emoji_list)
+  end
+
+  # Compile a list of ID link types for `parse`. Each type is a hash like `{ keyword: "artist", name: "artist", url:
+  # "/artists/" }`, which turns `artist #123` into a link to `/artists/123`. A type with the same keyword as a built-in ID
+  # link (`post #123`, etc) replaces its URL. With `page:`, `artist #123/p2` links to the URL, the ID, the `page` text and
+  # the page number (e.g. `page: "?page="` links to `/artists/123?page=2`); without it, `topic #123/p2` and
+  # `pixiv #123/p2` keep their built-in links. Compile the list once and reuse it; it's immutable and thread-safe.
+  def self.id_links(types)
+    c_id_links(types.map { |type| type.values_at(:keyword, :name, :url, :page) })
+  end
+
+  # Compile a list of internal URLs to shorten to ID links for `parse`. Each route is a hash like `{ path: "artists/:id",
+  # keyword: "artist", name: "artist", url: "/artists/" }`, which turns a link to `https://<domain>/artists/123` into
+  # `artist #123`. `:id` matches a number and a trailing `*` matches the rest of the path. With `query: false` or
+  # `fragment: false`, URLs with a query string or fragment aren't shortened. Routes are tried in order, before the
+  # built-in ones.
+  def self.routes(routes)
+    c_routes(routes.map { |route| [*route.values_at(:path, :keyword, :name, :url), route.fetch(:query, true), route.fetch(:fragment, true)] })
+  end
+
+  # Empty the cache of rendered blocks shared by every call to `parse` with `block_cache: true`.
+  def self.clear_block_cache
+    c_clear_block_cache
+  end
+
+  # How many bytes of DText and HTML the block cache holds before it starts dropping the least recently used blocks.
+  # Defaults to 16 MB.
+  def self.block_cache_size
+    c_block_cache_size
+  end
+
+  # Set the size of the block cache in bytes, dropping the least recently used blocks if it's over. 0 turns caching off.
+  def self.block_cache_size=(size)
+    c_set_block_cache_size(size)
+  end
+
+  # The SIMD level the parser's vectorized kernels are running at: "scalar", "sse2", "avx2" or "avx512". It's the best
+  # level the CPU supports, unless the `DTEXT_SIMD` environment variable was set to a lower one when the library was loaded.
+  def self.simd_level
+    c_simd_level
+  end
+
+  # The SIMD levels the CPU supports, from lowest to highest, any of which can be chosen with `DTEXT_SIMD`.
+  def self.simd_levels
+    c_simd_levels
+  end
+
+  # Register a list of emoji names under a name, to be passed to `parse` as `emoji_list: name` instead of passing the
+  # whole list as `emojis:` on every call. Names are matched case-insensitively. Registering a list again replaces it.
+  def self.register_emoji_list(name, emojis)
+    c_register_emoji_list(name, emojis)
+  end
+
+  # The result of `parse_incremental`: the input, its HTML, the index of its top-level blocks, the options, and the ID of
+  # the emoji list it was rendered with.
+  Rendering = Struct.new(:input, :html, :blocks, :options, :emoji_list_id)
+
+  # Parse `str` like `parse`, reusing the HTML of the blocks that haven't changed since `previous`, the result of an
+  # earlier call to `parse_incremental`. Returns a `DText::Rendering` to pass to the next call. `previous` is only reused
+  # if it was rendered with the same options: the same `id_links` and `routes` objects, and the same emoji list (not
+  # just the same name, since registering a list again replaces it).
+  def self.parse_incremental(str, previous = nil, inline: false, media_embeds: true, disable_mentions: false, base_url: nil, domain: nil, internal_domains: [], emojis: [], emoji_list: nil, max_output_size: nil, max_nesting: nil, max_steps: nil, id_links: nil, routes: nil)
+    options = [base_url, domain, internal_domains, emojis, inline, disable_mentions, media_embeds, max_output_size, max_nesting, max_steps, emoji_list, id_links, routes]
+    previous = nil unless previous&.options == options
+
+    html, blocks, emoji_list_id = c_parse_incremental(str, previous&.input, previous&.html, previous&.blocks, previous&.emoji_list_id, *options)
+    Rendering.new(str.dup.freeze, html, blocks, options, emoji_list_id)
+  end
+
+  # Parse DText incrementally. Pass the input to `DText::Stream#feed` in chunks; each call returns the HTML completed so
+  # far. `DText::Stream#finish` returns the rest. Takes the same options as `parse`, except for `threads`, `block_cache`,
+  # `digest` and `structural_index`.
+  def self.stream(inline: false, media_embeds: true, disable_mentions: false, base_url: nil, domain: nil, internal_domains: [], emojis: [], emoji_list: nil, max_output_size: nil, max_nesting: nil, max_steps: nil, id_links: nil, routes: nil)
+    c_stream(base_url, domain, internal_domains, emojis, inline, disable_mentions, media_embeds, max_output_size, max_nesting, max_steps, emoji_list, id_links, routes)
   end
 end
\ No newline at end of file
@@ -0,0 +1,97 @@
+# Builds the extension with profile-guided and link-time optimization, and reports the speedup over a normal build.
+#
+# An instrumented build is trained by parsing test/files/*.txt and the documents in test/files/*.json.gz (one JSON
+# object with a "text" field per line), then rebuilt with the profile and `-flto`. The builds are in tmp/pgo, and the
+# optimized extension is copied to lib/dtext.
+#
+#   bundle exec rake compile:pgo
+#   RUNS=50 bundle exec rake compile:pgo
+
+require "fileutils"
+require "rbconfig"
+
+RUNS = Integer(ENV.fetch("RUNS", 20))
+MAKE = ENV.fetch("MAKE", "make")
+
+root = File.expand_path("..", __dir__)
+tmp = File.join(root, "tmp/pgo")
+extconf = File.join(root, "ext/dtext/extconf.rb")
+profile = File.join(tmp, "profile")
+text_files = Dir[File.join(root, "test/files/*.txt")].sort
+json_files = Dir[File.join(root, "test/files/*.json.gz")].sort
+
+# Build the extension in `dir` with the given environment for extconf.rb, and install it in `dir`/lib.
+build = lambda do |dir, env = {}|
+  # The compiler's output goes to tmp/pgo/<build>/build.log.
+  log = File.join(dir, "build.log")
+  FileUtils.mkdir_p(File.join(dir, "lib/dtext"))
+  system(MAKE, "clean", chdir: dir, [:out, :err] => File::NULL) if File.exist?(File.join(dir, "Makefile"))
+  system(env, RbConfig.ruby, extconf, chdir: dir, [:out, :err] => log, exception: true)
+  system(MAKE, chdir: dir, [:out, :err] => [log, "a"], exception: true)
+
+  so = Dir[File.join(dir, "dtext.{so,bundle,dll}")].first
+  FileUtils.cp(so, File.join(dir, "lib/dtext"))
+  so
+end
+
+# Run a script in a new process with the extension built in `dir`.
+run = lambda do |dir, script|
+  IO.popen([RbConfig.ruby, "-I", File.join(dir, "lib"), "-I", File.join(root, "lib"), "-e", script], &:read)
+end
+
+train = <<~RUBY
+  require "dtext"
+  require "json"
+  require "zlib"
+
+  options = { domain: "danbooru.donmai.us", internal_domains: %w[danbooru.donmai.us] }
+  parse = ->(text) { DText.parse(text, **options) rescue nil; DText.parse(text, inline: true, **options) rescue nil }
+
+  #{text_files.inspect}.each { |file| text = File.read(file); 10.times { parse.(text) } }
+  #{json_files.inspect}.each { |file| Zlib::GzipReader.open(file) { |gz| gz.each_line { |line| parse.(JSON.parse(line)["text"].to_s) } } }
+RUBY
+
+benchmark = <<~RUBY
+  require "dtext"
+
+  clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+  #{text_files.inspect}.each do |file|
+    input = File.read(file)
+    DText.parse(input)
+    t0 = clock.call
+    #{RUNS}.times { DText.parse(input) }
+    print input.bytesize * #{RUNS} / (clock.call - t0) / 1_000_000, " "
+  end
+RUBY
+
+baseline = File.join(tmp, "baseline")
+optimized = File.join(tmp, "optimized")
+
+puts "Building the baseline extension..."
+build.(baseline)
+
+# The instrumented and optimized builds share a directory, since the profile is keyed by the path of each object file.
+puts "Building the instrumented extension..."
+FileUtils.rm_rf(profile)
+build.(optimized, "DTEXT_PGO_GENERATE" => profile)
+
+puts "Training on #{(text_files + json_files).map { |file| File.basename(file) }.join(", ")}..."
+abort "No training files in test/files." if text_files.empty? && json_files.empty?
+run.(optimized, train)
+
+# The optimized build ignores a missing profile (see extconf.rb), so check that training worked before using it.
+abort "Training failed (#{$?})." unless $?.success?
+abort "Training didn't write a profile to #{profile}." if Dir[File.join(profile, "**/*.gcda")].empty?
+
+puts "Building the optimized extension..."
+so = build.(optimized, "DTEXT_PGO_USE" => profile, "DTEXT_LTO" => "1")
+FileUtils.cp(so, File.join(root, "lib/dtext"))
+
+before = run.(baseline, benchmark).split.map(&:to_f)
+after = run.(optimized, benchmark).split.map(&:to_f)
+
+puts
+puts format("%-16s %14s %14s %8s", "file", "baseline", "pgo+lto", "speedup")
+text_files.each_with_index do |file, i|
+  puts format("%-16s %9.1f MB/s %9.1f MB/s %7.2fx", File.basename(file, ".txt")[0, 16], before[i], after[i], after[i] / before[i])
+end
@@ -0,0 +1,74 @@
+# Compares the code generation styles of Ragel. Each style's scanner is generated and compiled side by side in
+# tmp/ragel/<style>, then run on the test files in a separate process. Reports the time taken by ragel and by the
+# compiler, the size of the extension, and the parsing throughput for each style, and checks that every style gives
+# the same output.
+#
+#   bundle exec rake bench:ragel_styles
+#   STYLES="-T0 -G2" RUNS=50 bundle exec rake bench:ragel_styles
+
+require "benchmark"
+require "fileutils"
+require "rbconfig"
+
+STYLES = ENV.fetch("STYLES", "-T0 -T1 -F1 -G0 -G1 -G2").split
+RUNS = Integer(ENV.fetch("RUNS", 20))
+MAKE = ENV.fetch("MAKE", "make")
+
+root = File.expand_path("..", __dir__)
+ext = File.join(root, "ext/dtext")
+files = Dir[File.join(root, "test/files/*.txt")].sort
+
+script = <<~RUBY
+  require "digest"
+  require "dtext"
+
+  clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+  inputs = #{files.inspect}.map { |file| File.read(file) }
+  digest = Digest::SHA256.new
+
+  inputs.each do |input|
+    digest << DText.parse(input)
+    t0 = clock.call
+    #{RUNS}.times { DText.parse(input) }
+    print (input.bytesize * #{RUNS} / (clock.call - t0) / 1_000_000).round(1), " "
+  end
+
+  puts digest.hexdigest[0, 16]
+RUBY
+
+results = STYLES.map do |style|
+  dir = File.join(root, "tmp/ragel", style.delete("-"))
+  build = File.join(dir, "build")
+  lib = File.join(dir, "lib/dtext")
+
+  FileUtils.rm_rf(dir)
+  FileUtils.mkdir_p([build, lib])
+  FileUtils.cp(Dir[File.join(ext, "*.{h,rb}")] + Dir[File.join(ext, "*.cpp")] - [File.join(ext, "dtext.cpp")], dir)
+
+  ragel_time = Benchmark.realtime do
+    system("ragel", style, File.join(ext, "dtext.cpp.rl"), "-o", File.join(dir, "dtext.cpp"), exception: true)
+  end
+
+  compile_time = Benchmark.realtime do
+    # The compiler's output goes to tmp/ragel/<style>/build/build.log.
+    log = File.join(build, "build.log")
+    system(RbConfig.ruby, File.join(dir, "extconf.rb"), chdir: build, [:out, :err] => log, exception: true)
+    system(MAKE, chdir: build, [:out, :err] => [log, "a"], exception: true)
+  end
+
+  so = Dir[File.join(build, "dtext.{so,bundle,dll}")].first
+  FileUtils.cp(so, lib)
+
+  output = IO.popen([RbConfig.ruby, "-I", File.dirname(lib), "-I", File.join(root, "lib"), "-e", script], &:read).split
+  { style:, ragel_time:, compile_time:, size: File.size(so), throughput: output[0...-1], digest: output.last }
+end
+
+puts format("%-6s %9s %9s %10s  %s", "style", "ragel", "compile", "size", files.map { |file| format("%14s", File.basename(file, ".txt")[0, 14]) }.join(" "))
+
+results.each do |result|
+  puts format("%-6s %8.1fs %8.1fs %8d KB  %s", result[:style], result[:ragel_time], result[:compile_time], result[:size] / 1024, result[:throughput].map { |mbs| format("%9s MB/s", mbs) }.join(" "))
+end
+
+if results.map { |result| result[:digest] }.uniq.size > 1
+  abort "The styles gave different output: #{results.map { |result| "#{result[:style]} #{result[:digest]}" }.join(", ")}"
+end
@@ -0,0 +1,39 @@
+# Measures the cost of loading the library and of the first parse in a fresh process, which is what a newly
+# (pre)forked worker pays on its first request.
+#
+#   bundle exec rake bench:require
+
+require "benchmark"
+require "rbconfig"
+
+RUNS = Integer(ENV.fetch("RUNS", 20))
+lib = File.expand_path("../lib", __dir__)
+input = File.expand_path("files/dtext.txt", __dir__)
+
+script = <<~RUBY
+  clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+  input = File.read(#{input.dump})
+
+  t0 = clock.call
+  require "dtext"
+  t1 = clock.call
+  DText.parse(input)
+  t2 = clock.call
+  DText.parse(input)
+  t3 = clock.call
+
+  puts [t1 - t0, t2 - t1, t3 - t2].join(" ")
+RUBY
+
+samples = RUNS.times.map do
+  IO.popen([RbConfig.ruby, "-I", lib, "-e", script], &:read).split.map(&:to_f)
+end
+
+def median(values)
+  sorted = values.sort
+  (sorted[(sorted.size - 1) / 2] + sorted[sorted.size / 2]) / 2
+end
+
+["require \"dtext\"", "first parse", "second parse"].each_with_index do |label, i|
+  puts format("%-16s %8.3f ms (median of %d runs)", label, median(samples.map { _1[i] }) * 1000, RUNS)
+end
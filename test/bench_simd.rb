@@ -0,0 +1,48 @@
+# Compares the SIMD levels (see `DText.simd_levels`). Each level is run in a separate process with `DTEXT_SIMD` set, on
+# documents with long runs of plain text between markup, and on documents where markup or escaped characters come every
+# few bytes, so that most searches stop within the first vector.
+#
+#   bundle exec rake bench:simd
+#   RUNS=200 bundle exec rake bench:simd
+
+require "dtext"
+require "rbconfig"
+
+RUNS = Integer(ENV.fetch("RUNS", 50))
+
+inputs = {
+  "touhou wiki" => File.read(File.expand_path("files/touhou-wiki.txt", __dir__)),
+  "long runs" => "#{"Neko Tama-nee is the secret guardian of Danbooru. " * 20}[b]foo[/b]\n\n" * 200,
+  "long [code]" => "[code]#{"int x = y * 2; // some code\n" * 2_000}[/code]",
+  "short runs" => "a [b]b[/b] <c> d & e \"f\" @g {{h}} [[i]]\n" * 2_000,
+  "short [code]" => "[code]#{"a<b>&\"c\" " * 4_000}[/code]",
+}
+
+script = <<~RUBY
+  require "dtext"
+
+  clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+  inputs = Marshal.load($stdin.read)
+
+  inputs.each do |input|
+    DText.parse(input)
+    t0 = clock.call
+    #{RUNS}.times { DText.parse(input) }
+    print (input.bytesize * #{RUNS} / (clock.call - t0) / 1_000_000).round(1), " "
+  end
+RUBY
+
+results = DText.simd_levels.to_h do |level|
+  output = IO.popen({ "DTEXT_SIMD" => level }, [RbConfig.ruby, "-I", File.expand_path("../lib", __dir__), "-e", script], "r+") do |io|
+    io.write(Marshal.dump(inputs.values))
+    io.close_write
+    io.read
+  end
+
+  [level, output.split]
+end
+
+puts format("%-14s %s", "", results.keys.map { |level| format("%11s", level) }.join(" "))
+inputs.keys.each_with_index do |name, i|
+  puts format("%-14s %s", name, results.values.map { |throughput| format("%6s MB/s", throughput[i]) }.join(" "))
+end
@@ -0,0 +1,17 @@
+# Measures parsing URL-heavy text: bare URLs, links to internal URLs that are shortened to ID links, and named links.
+#
+#   bundle exec rake bench:urls
+
+require "benchmark/ips"
+require "dtext"
+
+bare_urls = 200.times.map { |i| "https://example.com/posts/#{i}?tags=touhou#comment-#{i}" }.join(" ")
+internal_urls = 200.times.map { |i| "https://danbooru.donmai.us/posts/#{i} https://danbooru.donmai.us/wiki/touhou_#{i}" }.join(" ")
+named_urls = 200.times.map { |i| %{"link #{i}":[https://example.com/artworks/#{i}] [url=https://danbooru.donmai.us/pools/#{i}]pool[/url]} }.join(" ")
+options = { domain: "danbooru.donmai.us", internal_domains: ["danbooru.donmai.us"] }
+
+Benchmark.ips do |bm|
+  bm.report("bare urls") { DText.parse(bare_urls, **options) }
+  bm.report("internal urls") { DText.parse(internal_urls, **options) }
+  bm.report("named urls") { DText.parse(named_urls, **options) }
+end
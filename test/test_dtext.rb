@@ -47,6 +47,13 @@ class DTextTest < Minitest::Test
     assert_equal(expected.sort, DText.c_parse_wiki_pages(dtext).sort)
   end
 
+  # Yield `count` random strings, each a random number (in `lengths`) of `pieces`. The seed is fixed, so a failure is
+  # reproducible.
+  def each_random_input(pieces, lengths, count)
+    random = Random.new(1)
+    count.times { yield Array.new(random.rand(lengths)) { pieces.sample(random:) }.join }
+  end
+
   def test_relative_urls
     assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="http://danbooru.donmai.us/posts/1234">post #1234</a></p>', "post #1234", base_url: "http://danbooru.donmai.us")
     assert_parse('<p><a class="dtext-link dtext-wiki-link" href="http://danbooru.donmai.us/wiki/touhou">touhou</a></p>', "[[touhou]]", base_url: "http://danbooru.donmai.us")
@@ -329,6 +336,23 @@ class DTextTest < Minitest::Test
     assert_parse('<p>[[|long hair]]</p>', "[[|long hair]]")
   end
 
+  def test_tag_qualifier_stripping
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/foo_%28%29">foo_()</a></p>', "[[foo_()|]]")
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/%28bar%29">(bar)</a></p>', "[[(bar)|]]")
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/foo_%28a%29b%29">foo_(a)b)</a></p>', "[[foo_(a)b)|]]")
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/foo_%28a_%28b%29">foo</a></p>', "[[foo_(a_(b)|]]")
+    assert_parse('<p><a class="dtext-link dtext-post-search-link" href="/posts?tags=foo_%28a%29_%28b%29">foo_(a)</a></p>', "{{foo_(a)_(b)|}}")
+
+    # The qualifier is stripped exactly as it was when this was done with a regex.
+    each_random_input("a_ ()".chars, 0..12, 2000) do |input|
+      tag = ("a" + input).rstrip
+      title = tag.sub(/[ _]\([^)]+?\)\z/, "")
+
+      assert_match(%r{>#{Regexp.escape(title)}</a>}, DText.parse("[[#{tag}|]]"))
+      assert_match(%r{>#{Regexp.escape(title)}</a>}, DText.parse("{{#{tag}|}}"))
+    end
+  end
+
   def test_wiki_links_anchor
     assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/touhou#dtext-see-also">touhou</a></p>', '[[touhou#See also]]')
     assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/touhou#dtext-see-also">touhou</a></p>', '[[touhou#See-Also]]')
@@ -361,6 +385,12 @@ class DTextTest < Minitest::Test
     assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/http%3A%2F%2Fen.wikipedia.org%2Fwiki%2Fgolden_age_of_detective_fiction#dtext-description-of-the-genre">Knox Decalogue</a></p>', '[[http://en.wikipedia.org/wiki/Golden_Age_of_Detective_Fiction#Description_of_the_genre| Knox Decalogue]]') # XXX wrong
   end
 
+  def test_wiki_link_stale_anchor
+    # The anchor isn't taken from an earlier search link that failed to match.
+    assert_parse('<p>{{[|h<br><a class="dtext-link dtext-wiki-link" href="/wiki/h">h</a></p>', "{{[|h\n[[h]]")
+    assert_parse('<p>{{a|Foo<br><a class="dtext-link dtext-wiki-link" href="/wiki/h">h</a></p>', "{{a|Foo\n[[h]]")
+  end
+
   def test_spoilers
     assert_parse("<p>this is <span class=\"spoiler\">an inline spoiler</span>.</p>", "this is [spoiler]an inline spoiler[/spoiler].")
     assert_parse("<p>this is <span class=\"spoiler\">an inline spoiler</span>.</p>", "this is [SPOILERS]an inline spoiler[/SPOILERS].")
@@ -722,6 +752,32 @@ class DTextTest < Minitest::Test
     assert_parse("<p>foo <code>bar </code></p>", "foo [code] \nbar \n[/code]")
   end
 
+  def test_html_escaping
+    assert_parse("<pre>&lt;&gt;&amp;&quot;</pre>", '[code]<>&"[/code]')
+    assert_parse("<pre>#{"a" * 15}&lt;#{"b" * 16}&amp;#{"c" * 17}&quot;</pre>", "[code]#{"a" * 15}<#{"b" * 16}&#{"c" * 17}\"[/code]")
+
+    # Special characters before, in and after each 16-byte chunk give the same result as escaping one byte at a time.
+    each_random_input(["a", " ", "\n", "é", "<", ">", "&", '"'], 0..70, 2000) do |input|
+      code = "x#{input}x"
+      assert_parse("<pre>#{CGI.escapeHTML(code)}</pre>", "[code]#{code}[/code]")
+    end
+  end
+
+  def test_verbatim_text
+    code = "if (a[i] < b && c</d) {\n  x[/i] = \"<y>\";\n}\n[code]"
+    assert_parse("<pre>#{CGI.escapeHTML(code)}</pre>", "[code]#{code}[/code]")
+    assert_parse("<pre>#{CGI.escapeHTML(code)}</pre>", "[code]#{code}</code>")
+    assert_parse("<pre>#{CGI.escapeHTML(code)}</pre>", "[code]#{code}\n[/code]")
+    assert_parse("<p>#{CGI.escapeHTML(code)}</p>", "[nodtext]#{code}[/nodtext]")
+    assert_parse("<p>a &lt;/nodtex [/nodte&gt;b</p>", "[nodtext]a </nodtex [/nodte>b[/NODTEXT]")
+
+    ["[code]#{code}[/code]\n\nfoo", "[nodtext]#{code}", "<nodtext>bc \n\n"].each do |dtext|
+      [1, 2, 5, dtext.size].each do |chunk_size|
+        assert_equal(parse(dtext), stream(dtext, chunk_size), "#{dtext.inspect} in chunks of #{chunk_size}")
+      end
+    end
+  end
+
   def test_code_fence
     assert_parse('<pre>code</pre>', "```\ncode\n```")
     assert_parse('<pre>code</pre>', "``` \ncode\n``` ")
@@ -930,6 +986,46 @@ class DTextTest < Minitest::Test
     assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/touhou">touhou</a></p>', 'https://danbooru.donmai.us/wiki/touhou', internal_domains: %w[danbooru.donmai.us])
   end
 
+  def test_internal_domain_matching
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://Danbooru.Donmai.US/posts/1234', internal_domains: %w[danbooru.donmai.us])
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://danbooru.donmai.us/posts/1234', internal_domains: %w[DANBOORU.donmai.us])
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://safebooru.donmai.us/posts/1234', internal_domains: %w[*.donmai.us])
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://a.b.donmai.us/posts/1234', internal_domains: %w[*.donmai.us])
+    assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="https://donmai.us/posts/1234">https://donmai.us/posts/1234</a></p>', 'https://donmai.us/posts/1234', internal_domains: %w[*.donmai.us])
+    assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="https://evildonmai.us/posts/1234">https://evildonmai.us/posts/1234</a></p>', 'https://evildonmai.us/posts/1234', internal_domains: %w[*.donmai.us])
+    assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="https://cdn.danbooru.donmai.us/posts/1234">https://cdn.danbooru.donmai.us/posts/1234</a></p>', 'https://cdn.danbooru.donmai.us/posts/1234', internal_domains: %w[danbooru.donmai.us])
+
+    assert_parse('<p><a class="dtext-link" href="https://CDN.donmai.us/1.jpg">https://CDN.donmai.us/1.jpg</a></p>', 'https://CDN.donmai.us/1.jpg', domain: "*.donmai.us")
+    assert_parse('<p><a class="dtext-link" href="https://Danbooru.donmai.us/1.jpg">https://Danbooru.donmai.us/1.jpg</a></p>', 'https://Danbooru.donmai.us/1.jpg', domain: "danbooru.donmai.us")
+    assert_parse('<p><a class="dtext-link" href="https://user@CDN.donmai.us:443/1.jpg">foo</a></p>', '"foo":[https://user@CDN.donmai.us:443/1.jpg]', domain: "*.donmai.us")
+  end
+
+  def test_internal_link_to_shortlink_conversion_with_routes
+    routes = DText.routes([
+      { path: "artists/:id", keyword: "artist", name: "artist", url: "/artists/" },
+      { path: "forum_topics/:id", keyword: "topic", name: "forum-topic", url: "/forum_topics/", query: false, fragment: false },
+      { path: "posts/:id/*", keyword: "post", name: "post", url: "/posts/" },
+      { path: "gists/:id", keyword: "gist", name: "gist", url: "https://gist.github.com/" },
+    ])
+
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-artist-id-link" href="/artists/1234">artist #1234</a></p>', 'https://danbooru.donmai.us/artists/1234', internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-artist-id-link" href="http://danbooru.donmai.us/artists/1234">artist #1234</a></p>', 'https://danbooru.donmai.us/artists/1234', base_url: "http://danbooru.donmai.us", internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-forum-topic-id-link" href="/forum_topics/1234">topic #1234</a></p>', 'https://danbooru.donmai.us/forum_topics/1234', internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link" href="https://danbooru.donmai.us/forum_topics/1234?page=2">https://danbooru.donmai.us/forum_topics/1234?page=2</a></p>', 'https://danbooru.donmai.us/forum_topics/1234?page=2', domain: "danbooru.donmai.us", internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://danbooru.donmai.us/posts/1234/', internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', 'https://danbooru.donmai.us/posts/1234#comment_5678', internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-id-link dtext-gist-id-link" href="https://gist.github.com/1234">gist #1234</a></p>', 'https://danbooru.donmai.us/gists/1234', internal_domains: %w[danbooru.donmai.us], routes: routes)
+
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-pool-id-link" href="/pools/1234">pool #1234</a></p>', 'https://danbooru.donmai.us/pools/1234', internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link" href="https://danbooru.donmai.us/artists/touhou">https://danbooru.donmai.us/artists/touhou</a></p>', 'https://danbooru.donmai.us/artists/touhou', domain: "danbooru.donmai.us", internal_domains: %w[danbooru.donmai.us], routes: routes)
+    assert_parse('<p><a class="dtext-link" href="https://danbooru.donmai.us/artists/1234">https://danbooru.donmai.us/artists/1234</a></p>', 'https://danbooru.donmai.us/artists/1234', domain: "danbooru.donmai.us", internal_domains: %w[danbooru.donmai.us])
+
+    assert_raises(DText::Error) { DText.routes([{ path: "artists", keyword: "artist", name: "artist", url: "/artists/" }]) }
+    assert_raises(DText::Error) { DText.routes([{ path: "artists/:id/:id", keyword: "artist", name: "artist", url: "/artists/" }]) }
+    assert_raises(DText::Error) { DText.routes([{ path: "*/:id", keyword: "artist", name: "artist", url: "/artists/" }]) }
+    assert_raises(DText::Error) { DText.routes([{ path: "artists/:id", keyword: "artist #", name: "artist", url: "/artists/" }]) }
+  end
+
   def test_old_style_links
     assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link dtext-named-external-link" href="http://test.com">test</a></p>', '"test":http://test.com')
     assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link dtext-named-external-link" href="Http://test.com">test</a></p>', '"test":Http://test.com')
@@ -1533,6 +1629,14 @@ class DTextTest < Minitest::Test
     assert_parse('<p>{{|bb_(fate)}}</p>', "{{|bb_(fate)}}")
   end
 
+  def test_uri_escaping
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/%E6%9D%B1%E6%96%B9project">東方Project</a></p>', "[[東方Project]]")
+
+    each_random_input(["a", "Z", "0", "-", "_", ".", "~", "%", "&", "#", "/", "+", "*", "'", "東", "é"], 1..60, 500) do |search|
+      assert_match(%{href="/posts?tags=#{CGI.escapeURIComponent(search)}"}, DText.parse("{{#{search}}}"))
+    end
+  end
+
   def test_extra_newlines
     assert_parse('<p>a</p><p>b</p>', "a\n\n\n\n\n\n\nb\n\n\n\n")
 
@@ -2087,6 +2191,44 @@ class DTextTest < Minitest::Test
     assert_parse('<h4><emoji data-name="smile" data-mode="inline"></emoji></h4>', "<h4>:smile:</h4>", emojis:)
   end
 
+  def test_ascii_normalization
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/~2019">2019</a> <a class="dtext-link dtext-wiki-link" href="/wiki/%EF%BC%92%EF%BC%90%EF%BC%91%EF%BC%99">２０１９</a> <a class="dtext-link dtext-wiki-link" href="/wiki/20_19">20 19</a></p>', "[[2019]] [[２０１９]] [[20 19]]")
+    assert_parse('<p><a class="dtext-link dtext-wiki-link" href="/wiki/%C3%89clair_cake">Éclair Cake</a></p>', "[[Éclair Cake]]")
+    assert_parse('<p>:ÉCLAIR: <emoji data-name="cool_cat" data-mode="inline"></emoji></p>', ":ÉCLAIR: :Cool_Cat:", emojis: ["Éclair", "cool_cat"])
+    assert_parse('<table class="highlightable"><tr><td>x</td><td colspan="12">y</td></tr></table>', '[table][tr][td colspan="２"]x[/td][td colspan="12"]y[/td][/tr][/table]')
+
+    # Longer than the buffers the names are normalized in.
+    tag = "Ab " * 100 + "Ab"
+    anchor = "See Also " + "x" * 300
+    assert_parse(%{<p><a class="dtext-link dtext-wiki-link" href="/wiki/#{"ab_" * 100}ab#dtext-see-also-#{"x" * 300}">#{tag}</a></p>}, "[[#{tag}##{anchor}]]")
+    assert_parse(%{<h2 id="dtext-#{"a-b" * 100}">t</h2>}, "h2##{"A-b" * 100}. t")
+
+    emoji = "Long_" * 30
+    assert_parse(%{<emoji data-name="#{emoji.downcase}" data-mode="block"></emoji>}, ":#{emoji}:", emojis: [emoji.downcase])
+  end
+
+  def test_emoji_list
+    DText.register_emoji_list("test", %w[smile Heart])
+
+    assert_parse('<p>foo <emoji data-name="smile" data-mode="inline"></emoji></p>', "foo :smile:", emoji_list: "test")
+    assert_parse('<emoji data-name="heart" data-mode="block"></emoji>', ":HEART:", emoji_list: "test")
+    assert_parse('<p><emoji data-name="frown" data-mode="inline"></emoji><emoji data-name="smile" data-mode="inline"></emoji>:wink:</p>', ":frown::smile::wink:", emoji_list: "test", emojis: %w[frown])
+    assert_parse('<p>:smile:</p>', ":smile:")
+
+    names = 5000.times.map { |i| "emoji_#{i.to_s(36)}" }
+    DText.register_emoji_list("test", names)
+
+    assert_parse('<p>:smile:</p>', ":smile:", emoji_list: "test")
+    names.each { |name| assert_parse(%{<emoji data-name="#{name}" data-mode="block"></emoji>}, ":#{name.upcase}:", emoji_list: "test") }
+    %w[emoji_ emoji_3w6 emoji_3w5x emoji_0_ emoji].each { |name| assert_parse("<p>:#{name}:</p>", ":#{name}:", emoji_list: "test") }
+
+    assert_equal('<p><emoji data-name="emoji_1" data-mode="inline"></emoji>bar</p>', DText.stream(emoji_list: "test").then { |s| s.feed(":emoji_1:") + s.feed("bar") + s.finish })
+    assert_equal('<p><emoji data-name="emoji_1" data-mode="inline"></emoji>bar</p>', DText.parse_incremental(":emoji_1:bar", emoji_list: "test").html)
+
+    assert_raises(DText::Error) { parse(":smile:", emoji_list: "nonexistent") }
+    assert_raises(DText::Error) { DText.register_emoji_list("test", ["smile face"]) }
+  end
+
   def test_inline_mode
     assert_equal("hello", parse_inline("hello").strip)
   end
@@ -2258,6 +2400,378 @@ class DTextTest < Minitest::Test
     assert_wiki(touhou_tags, File.read("test/files/touhou-wiki.txt"))
   end
 
+  def test_unterminated_markup_is_linear
+    # Without memoization, each of these would rescan the rest of the input from every copy of the markup, taking
+    # about 10_000 steps per byte instead of less than 50.
+    ["[[a", %("a":[), %(<a href="/x">), "[url="].each do |markup|
+      input = markup * 20_000
+      parse(input, max_steps: 64 * input.size)
+    end
+
+    assert_parse('<p>[[a[[a[[a</p>', "[[a[[a[[a")
+    assert_parse('<p>&lt;a href=&quot;/x&quot;&gt;&lt;a href=&quot;/x&quot;&gt;</p>', %(<a href="/x"><a href="/x">))
+  end
+
+  def test_resource_limits
+    assert_raises(DText::Error) { parse("post #1 " * 100, max_output_size: 1_000) }
+    assert_raises(DText::Error) { parse("[quote]" * 10, max_nesting: 8) }
+    assert_raises(DText::Error) { parse("[[a" * 1_000, max_steps: 1_000) }
+
+    # Text skipped over without running the scanner counts toward the limit too.
+    assert_raises(DText::Error) { parse("a, " * 1_000, max_steps: 1_000) }
+    assert_raises(DText::Error) { parse("[code]#{"a, " * 1_000}[/code]", max_steps: 1_000) }
+    assert_raises(DText::Error) { parse("[nodtext]#{"a, " * 1_000}[/nodtext]", max_steps: 1_000) }
+    assert_raises(DText::Error) { parse("artist #1 " * 200, max_steps: 1_000, id_links: DText.id_links([{ keyword: "artist", name: "artist", url: "/artists/" }])) }
+    parse("a, " * 1_000, max_steps: 5_000)
+
+    # A character is only counted once in states with conditions, where the scanner reads it a second time to test them
+    # (here, whether the `@` is at a mention boundary).
+    assert_equal(9, (1..100).bsearch { |max_steps| parse("@bob", max_steps:).is_a?(String) rescue false })
+    assert_equal(13, (1..100).bsearch { |max_steps| parse("a @bob", max_steps:).is_a?(String) rescue false })
+
+    # The limit applies to output copied from the block cache, from a previous rendering and across stream chunks.
+    input = (["#{"[[foo]] " * 20}"] * 100).join("\n\n")
+    parse(input, block_cache: true)
+    assert_raises(DText::Error) { parse(input, block_cache: true, max_output_size: 10_000) }
+    previous = DText.parse_incremental(input)
+    assert_raises(DText::Error) { DText.parse_incremental("#{input}!", previous, max_output_size: 10_000) }
+    assert_raises(DText::Error) { stream(input, 100, max_output_size: 10_000) }
+
+    # With threads, the limits apply to the whole document, even if one part needs more than its share of them. The
+    # token at each split is started by two machines, so each split can count one more step.
+    input = "#{"[[foo]] " * 10_000}\n\n#{"foo\n\n" * 10_000}"
+    html = parse(input)
+    steps = (1..100 * input.size).bsearch { |max_steps| parse(input, max_steps:).is_a?(String) rescue false }
+    assert_equal(html, parse(input, threads: 4, max_steps: steps + 3))
+    assert_raises(DText::Error) { parse(input, threads: 4, max_steps: steps - 1) }
+    assert_equal(html, parse(input, threads: 4, max_output_size: html.size))
+    assert_raises(DText::Error) { parse(input, threads: 4, max_output_size: html.size - 1) }
+
+    assert_parse("<p>foo</p>", "foo", max_output_size: 10, max_nesting: 2, max_steps: 10)
+    assert_parse("<blockquote><blockquote><p>foo</p></blockquote></blockquote>", "[quote][quote]foo", max_nesting: 3)
+  end
+
+  def stream(input, chunk_size, **options)
+    stream = DText.stream(**options)
+    html = input.b.chars.each_slice(chunk_size).map { |chunk| stream.feed(chunk.join) }.join
+    html + stream.finish
+  end
+
+  def test_stream
+    Dir["test/files/*.txt"].each do |file|
+      input = File.read(file)
+
+      [1, 3, 64, input.size].each do |chunk_size|
+        assert_equal(parse(input), stream(input, chunk_size), "#{file} in chunks of #{chunk_size}")
+      end
+    end
+
+    assert_equal("<p>foo<br>bar</p>", stream("foo\r\nbar", 4))
+    assert_equal("<p>foo bar</p>", stream("foo\rbar", 4))
+    assert_equal("<p>東方</p>", stream("東方", 1))
+    assert_equal('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a></p>', stream("post #1234", 1))
+
+    id_links = DText.id_links([{ keyword: "artist", name: "artist", url: "/artists/", page: "?page=" }, { keyword: "artist version", name: "artist-version", url: "/artist_versions/" }])
+    input = "artist #1 [b]artist #23/p4[/b] artist version #5, artist #abcdefghijk artist #6/p artist #7"
+    [1, 3, 8, input.size].each do |chunk_size|
+      assert_equal(parse(input, id_links:), stream(input, chunk_size, id_links:), "in chunks of #{chunk_size}")
+    end
+
+    routes = DText.routes([{ path: "artists/:id", keyword: "artist", name: "artist", url: "/artists/" }])
+    input = "foo https://danbooru.donmai.us/artists/123 bar https://danbooru.donmai.us/posts/4"
+    assert_equal(parse(input, internal_domains: %w[danbooru.donmai.us], routes:), stream(input, 5, internal_domains: %w[danbooru.donmai.us], routes:))
+    assert_match("artist #123", stream(input, 5, internal_domains: %w[danbooru.donmai.us], routes:))
+
+    stream = DText.stream
+    assert_equal("<p>foo</p>", stream.feed("foo") + stream.finish)
+    assert_raises(DText::Error) { stream.feed("bar") }
+    assert_raises(DText::Error) { stream.finish }
+
+    assert_raises(DText::Error) { DText.stream.feed("foo\0bar") }
+    assert_raises(DText::Error) { DText.stream.tap { _1.feed("\xE6\x9D") }.finish }
+    assert_raises(DText::Error) { DText.stream.feed("\xFF") }
+  end
+
+  def test_parallel_parse
+    Dir["test/files/*.txt"].each do |file|
+      input = ([File.read(file)] * 40).join("\n\n")
+      assert_equal(parse(input), parse(input, threads: 4), file)
+    end
+
+    input = "[quote]\n\n#{"foo\n\n" * 10_000}[/quote]\n\n#{"[[bar]] " * 10_000}"
+    assert_equal(parse(input), parse(input, threads: 4))
+  end
+
+  def test_block_boundaries
+    # Only parses that split the document into blocks reset the scanner at block boundaries, which doesn't change the
+    # output of a serial parse.
+    ["{{a|Foo\n\n[[b]]", "{{a|Foo\n\n!post #1", "{{a|Foo\n!post #1", "[url=\n\n[[a]]", "[td a=\"b\"\n\n[table][tr][td]c[/td][/tr][/table]"].each do |block|
+      input = ([block] * 2000).join("\n\n")
+      assert_equal(parse(input), parse(input, threads: 4), block)
+      assert_equal(parse(input), parse(input, block_cache: true), block)
+      assert_equal(parse(input), DText.parse_incremental(input).html, block)
+    end
+  end
+
+  def test_block_cache
+    Dir["test/files/*.txt"].each do |file|
+      input = ([File.read(file)] * 4).join("\n\n")
+      assert_equal(parse(input), parse(input, block_cache: true), file)
+      assert_equal(parse(input), parse(input, block_cache: true), file)
+      assert_equal(parse(input, inline: true), parse(input, inline: true, block_cache: true), file)
+      assert_equal(parse(input), parse(input, block_cache: true, threads: 4), file)
+    end
+
+    quote = "[quote]\nfoo said:\n\n#{"[[bar]] " * 20}\n[/quote]\n\n"
+    assert_equal(parse("#{quote}baz"), parse("#{quote}baz", block_cache: true))
+    assert_equal(parse("#{quote}* baz"), parse("#{quote}* baz", block_cache: true))
+    assert_equal(parse("#{quote}[/quote]"), parse("#{quote}[/quote]", block_cache: true))
+    input = "#{":smile: " * 20}\n\nfoo"
+    assert_equal(parse(input, emojis: ["smile"]), parse(input, emojis: ["smile"], block_cache: true))
+    assert_equal(parse(input), parse(input, block_cache: true))
+
+    DText.register_emoji_list("test_block_cache", ["smile"])
+    assert_equal(parse(input, emoji_list: "test_block_cache"), parse(input, emoji_list: "test_block_cache", block_cache: true))
+    DText.register_emoji_list("test_block_cache", [])
+    assert_equal(parse(input), parse(input, emoji_list: "test_block_cache", block_cache: true))
+
+    input = "#{"artist #1234 " * 20}\n\nfoo"
+    id_links = DText.id_links([{ keyword: "artist", name: "artist", url: "/artists/" }])
+    assert_equal(parse(input, id_links:), parse(input, id_links:, block_cache: true))
+    id_links = DText.id_links([{ keyword: "artist", name: "artist", url: "/people/" }])
+    assert_equal(parse(input, id_links:), parse(input, id_links:, block_cache: true))
+    assert_equal(parse(input), parse(input, block_cache: true))
+  end
+
+  def test_block_cache_size
+    size = DText.block_cache_size
+    assert_equal(16 * 1024 * 1024, size)
+
+    input = ([File.read("test/files/touhou-wiki.txt")] * 4).join("\n\n")
+    DText.block_cache_size = 0
+    assert_equal(parse(input), parse(input, block_cache: true))
+    assert_equal(parse(input), parse(input, block_cache: true))
+
+    DText.block_cache_size = 1024
+    assert_equal(parse(input), parse(input, block_cache: true))
+    DText.clear_block_cache
+    assert_equal(parse(input), parse(input, block_cache: true))
+
+    assert_raises(TypeError) { DText.block_cache_size = "big" }
+  ensure
+    DText.block_cache_size = size
+  end
+
+  def test_digest
+    assert_equal(["", "ef46db3751d8e999"], parse("", digest: true))
+    assert_equal(["<p>a</p>", "6ea204f4b0107315"], parse("a", digest: true))
+
+    Dir["test/files/*.txt"].each do |file|
+      input = ([File.read(file)] * 10).join("\n\n")
+      html, digest = parse(input, digest: true)
+
+      assert_equal(parse(input), html, file)
+      assert_match(/\A\h{16}\z/, digest, file)
+      assert_equal([html, digest], parse(input, digest: true, threads: 4), file)
+      assert_equal([html, digest], parse(input, digest: true, block_cache: true), file)
+      refute_equal(digest, parse(input + "a", digest: true).last, file)
+    end
+  end
+
+  def test_plain_text_skipping
+    assert_parse('<p>Hello, world; see <a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/1234">post #1234</a>, or <a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="https://example.com">https://example.com</a>. Done.</p>', "Hello, world; see post #1234, or https://example.com. Done.")
+    assert_parse('<p>Quoted: &quot;x&quot; &amp; y &gt; z, then <a class="dtext-link dtext-user-mention-link" data-user-name="user" href="/users?name=user">@user</a>, (a@b.com) and <a class="dtext-link dtext-wiki-link" href="/wiki/tag">tags</a>.</p>', 'Quoted: "x" & y > z, then @user, (a@b.com) and [[tag]]s.')
+    assert_parse('<p><a class="dtext-link" href="/posts/1">Title, with <strong>bold</strong> &amp; <em>more</em> text</a></p>', '"Title, with [b]bold[/b] & <i>more</i> text":/posts/1')
+
+    # Streams only skip plain text once the last chunk has been fed, so they scan the text one token at a time.
+    inputs = Dir["test/files/*.txt"].map { |file| File.read(file) }
+    inputs += [
+      "Lorem ipsum, dolor sit amet; post #1234. " * 100,
+      "foo, bar post #1234 baz, tag mass edit #5 qux.",
+      "foo, bar[[baz]]qux, a{{touhou}}b, c https://example.com/ d, e mailto:a@b.com f.",
+      "[spoiler]foo, bar,  [/spoiler] baz,\t[/spoiler]",
+      "foo, @bar, baz@qux, <@quux>, a & b < c > d \"e\" f.",
+      "日本語、テキスト。post #1, 日本語[[テキスト]]。",
+      "foo, bar\r\nbaz, qux\n\n* a, b\n* c, d\n\nh1. e, f",
+    ]
+
+    inputs.each do |input|
+      [1, 7, 64].each do |chunk_size|
+        assert_equal(parse(input), stream(input, chunk_size), "#{input[0, 40].inspect} in chunks of #{chunk_size}")
+      end
+    end
+  end
+
+  def test_structural_index
+    inputs = Dir["test/files/*.txt"].map { |file| File.read(file) }
+    inputs += [
+      "Lorem ipsum, dolor sit amet; post #1234. " * 100,
+      "foo, bar post #1234 baz, tag mass edit #5 qux.",
+      "foo, bar[[baz]]qux, a{{touhou}}b, c https://example.com/ d, e mailto:a@b.com f.",
+      "[spoiler]foo, bar,  [/spoiler] baz,\t[/spoiler]",
+      "foo, @bar, baz@qux, <@quux>, a & b < c > d \"e\" f.",
+      "日本語、テキスト。post #1, 日本語[[テキスト]]。",
+      "foo, bar\r\nbaz, qux\n\n* a, b\n* c, d\n\nh1. e, f",
+      "#{"x, " * 30}[b]y[/b]#{", z" * 30}",
+    ]
+
+    inputs.each do |input|
+      assert_equal(parse(input), parse(input, structural_index: true), input[0, 40])
+      assert_equal(parse(input, inline: true), parse(input, inline: true, structural_index: true), input[0, 40])
+      assert_equal(parse(input), parse(input, structural_index: true, threads: 4), input[0, 40])
+    end
+
+    id_links = DText.id_links([{ keyword: "foo-bar", name: "foo_bar", url: "/foo_bars/" }])
+    input = "x, foo-bar #1, y; foo-bar #2. [b]foo-bar #3[/b]"
+    assert_equal(parse(input, id_links: id_links), parse(input, id_links: id_links, structural_index: true))
+  end
+
+  def test_simd_levels
+    levels = DText.simd_levels
+    assert_equal("scalar", levels.first)
+    assert_equal(levels.last, DText.simd_level) unless ENV["DTEXT_SIMD"]
+
+    # Inputs of every length up to a few vectors, with the bytes each kernel looks for at random places.
+    random = Random.new(1234)
+    pieces = ["a", "bc ", "\n", "\r\n", "\r", "[", "]", "<", ">", "&", '"', "#", ":", "@", "{", "}", "[/", "[b]", "</i>", "é", "日本", "\0", "\xFF", "\xE3\x81"]
+    inputs = (0..200).map do |length|
+      input = +""
+      input << pieces.sample(random: random) while input.bytesize < length
+      input.force_encoding("UTF-8")
+    end
+    inputs += inputs.map { |input| "[code]#{input}[/code]" } + inputs.map { |input| "<nodtext>#{input}</nodtext>" } + inputs.map { |input| %{"#{input}":/posts} }
+
+    script = <<~'RUBY'
+      require "dtext"
+      inputs = Marshal.load($stdin.read)
+      results = inputs.map do |input|
+        [false, true].flat_map do |structural_index|
+          [false, true].map do |inline|
+            DText.parse(input, inline: inline, structural_index: structural_index)
+          rescue DText::Error => e
+            e.message
+          end
+        end
+      end
+      $stdout.write(Marshal.dump([DText.simd_level, results]))
+    RUBY
+
+    outputs = levels.to_h do |level|
+      output = IO.popen({ "DTEXT_SIMD" => level }, [RbConfig.ruby, "-I#{File.expand_path("../lib", __dir__)}", "-e", script], "r+b") do |io|
+        io.write(Marshal.dump(inputs))
+        io.close_write
+        io.read
+      end
+
+      [level, Marshal.load(output)]
+    end
+
+    levels.each do |level|
+      assert_equal(level, outputs[level][0])
+      inputs.each_with_index do |input, i|
+        assert_equal(outputs["scalar"][1][i], outputs[level][1][i], "#{level}: #{input.inspect}")
+      end
+    end
+
+    assert_equal(inputs.map { |input| parse(input) rescue $!.message }, outputs["scalar"][1].map(&:first))
+    outputs["scalar"][1].each_with_index { |results, i| assert_equal(results[0, 2], results[2, 2], inputs[i].inspect) }
+  end
+
+  def test_id_link_registry
+    id_links = DText.id_links([
+      { keyword: "artist", name: "artist", url: "/artists/" },
+      { keyword: "artist version", name: "artist-version", url: "/artist_versions/" },
+      { keyword: "gist", name: "gist", url: "https://gist.github.com/" },
+      { keyword: "book", name: "book", url: "/books/" },
+      { keyword: "pixiv", name: "pixiv", url: "/pixiv/" },
+    ])
+
+    assert_parse_id_link("dtext-artist-id-link", "/artists/123", "artist #123", id_links: id_links)
+    assert_parse_id_link("dtext-artist-version-id-link", "/artist_versions/123", "artist version #123", id_links: id_links)
+    assert_parse_id_link("dtext-gist-id-link", "https://gist.github.com/123", "gist #123", id_links: id_links)
+    assert_parse_id_link("dtext-book-id-link", "/books/123", "book #123", id_links: id_links)
+
+    assert_parse('<p>foo <a class="dtext-link dtext-id-link dtext-artist-id-link" href="/artists/123">artist #123</a>, bar</p>', "foo artist #123, bar", id_links: id_links)
+    assert_parse('<p>fooartist #123 artist #bar artist version #</p>', "fooartist #123 artist #bar artist version #", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-post-id-link" href="/posts/123">post #123</a></p>', "post #123", id_links: id_links)
+    assert_parse('<p><a rel="external nofollow noreferrer" class="dtext-link dtext-id-link dtext-pixiv-id-link" href="https://www.pixiv.net/artworks/123#2">pixiv #123/p2</a></p>', "pixiv #123/p2", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-pixiv-id-link" href="/pixiv/123">pixiv #123</a></p>', "pixiv #123", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-artist-id-link" href="/artists/123">artist #123</a>/p2</p>', "artist #123/p2", id_links: id_links)
+
+    id_links = DText.id_links([
+      { keyword: "artist", name: "artist", url: "/artists/", page: "?page=" },
+      { keyword: "pixiv", name: "pixiv", url: "/pixiv/", page: "/pages/" },
+      { keyword: "topic", name: "topic", url: "/topics/" },
+    ])
+
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-artist-id-link" href="/artists/123?page=2">artist #123/p2</a>, foo</p>', "artist #123/P2, foo", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-artist-id-link" href="/artists/123">artist #123</a>/p</p>', "artist #123/p", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-pixiv-id-link" href="/pixiv/123/pages/2">pixiv #123/p2</a></p>', "pixiv #123/p2", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-forum-topic-id-link" href="/forums/123?page=2">topic #123/p2</a></p>', "topic #123/p2", id_links: id_links)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-topic-id-link" href="/topics/123">topic #123</a></p>', "topic #123", id_links: id_links)
+
+    input = "[b]artist #1[/b] artist version #2, [[artist #3]], https://example.com/artist #4, foo artist #5"
+    assert_equal(parse(input, id_links: id_links), stream(input, 1, id_links: id_links))
+
+    # Keywords can contain any of the characters letters, digits, spaces, `_` and `-`, in ID links and in routes.
+    id_links = DText.id_links([{ keyword: "foo-bar", name: "foo-bar", url: "/foo_bars/" }, { keyword: "my_thing 2", name: "my-thing", url: "/my_things/" }])
+    input = "x foo-bar #1, my_thing 2 #3"
+    assert_parse('<p>x <a class="dtext-link dtext-id-link dtext-foo-bar-id-link" href="/foo_bars/1">foo-bar #1</a>, <a class="dtext-link dtext-id-link dtext-my-thing-id-link" href="/my_things/3">my_thing 2 #3</a></p>', input, id_links:)
+    [1, 3, input.size].each do |chunk_size|
+      assert_equal(parse(input, id_links:), stream(input, chunk_size, id_links:), "in chunks of #{chunk_size}")
+    end
+
+    routes = DText.routes([{ path: "foo_bars/:id", keyword: "foo-bar", name: "foo-bar", url: "/foo_bars/" }, { path: "my_things/:id", keyword: "my_thing 2", name: "my-thing", url: "/my_things/" }])
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-foo-bar-id-link" href="/foo_bars/1">foo-bar #1</a></p>', "https://danbooru.donmai.us/foo_bars/1", internal_domains: %w[danbooru.donmai.us], routes:)
+    assert_parse('<p><a class="dtext-link dtext-id-link dtext-my-thing-id-link" href="/my_things/3">my_thing 2 #3</a></p>', "https://danbooru.donmai.us/my_things/3", internal_domains: %w[danbooru.donmai.us], routes:)
+
+    assert_raises(DText::Error) { DText.id_links([{ keyword: "foo #", name: "foo", url: "/foo/" }]) }
+    assert_raises(DText::Error) { DText.id_links([{ keyword: "", name: "foo", url: "/foo/" }]) }
+  end
+
+  def test_parse_incremental
+    input = ([File.read("test/files/touhou-wiki.txt")] * 10).join("\n\n")
+    rendering = DText.parse_incremental(input)
+    assert_equal(parse(input), rendering.html)
+
+    edits = [
+      ->(s) { s.sub("Perfect Cherry Blossom", "[b]Perfect[/b] Cherry Blossom") },
+      ->(s) { s.insert(s.size / 2, "\n\n[quote]\n\nfoo") },
+      ->(s) { s.insert(0, "h1. Touhou\n\n") },
+      ->(s) { s + "\n\n* foo\n* bar" },
+      ->(s) { s.sub(/\[\[.*?\]\]/, "") },
+      ->(s) { s.sub("[quote]", "") },
+      ->(s) { s[0, s.size / 3] },
+    ]
+
+    edits.each do |edit|
+      input = edit.call(input.dup)
+      rendering = DText.parse_incremental(input, rendering)
+      assert_equal(parse(input), rendering.html)
+    end
+
+    assert_equal(parse(input, inline: true), DText.parse_incremental(input, rendering, inline: true).html)
+
+    input = "#{":smile: artist #1 " * 20}\n\nfoo"
+    DText.register_emoji_list("test_parse_incremental", ["smile"])
+    rendering = DText.parse_incremental(input, emoji_list: "test_parse_incremental")
+    DText.register_emoji_list("test_parse_incremental", [])
+    assert_equal(parse("#{input}!"), DText.parse_incremental("#{input}!", rendering, emoji_list: "test_parse_incremental").html)
+
+    id_links = DText.id_links([{ keyword: "artist", name: "artist", url: "/artists/" }])
+    routes = DText.routes([{ path: "people/:id", keyword: "artist", name: "artist", url: "/artists/" }])
+    rendering = DText.parse_incremental(input, id_links:, routes:)
+    assert_equal(parse(input, id_links:), rendering.html)
+    assert_equal(parse("#{input}!", id_links:), DText.parse_incremental("#{input}!", rendering, id_links:, routes:).html)
+    assert_equal(parse("#{input}!"), DText.parse_incremental("#{input}!", rendering).html)
+    assert_equal(parse("#{input}!", id_links:), DText.parse_incremental("#{input}!", rendering, id_links: DText.id_links([{ keyword: "artist", name: "artist", url: "/artists/" }])).html)
+
+    # A forged block index with a resume point past the end of the new input is ignored.
+    previous = DText.parse_incremental("a" * 5000)
+    forged = DText::Rendering.new(previous.input, previous.html, [4000, 0, 0], previous.options, previous.emoji_list_id)
+    assert_equal(parse("b"), DText.parse_incremental("b", forged).html)
+  end
+
   def test_null_bytes
     assert_raises(DText::Error) { parse("foo\0bar") }
   end
@@ -2267,9 +2781,26 @@ class DTextTest < Minitest::Test
     assert_parse("<p>foo</p>", "foo".dup.force_encoding("UTF-8"))
     assert_raises(DText::Error) { parse("foo".dup.force_encoding("ASCII-8BIT")) }
     assert_raises(DText::Error) { parse("\xFF".dup.force_encoding("US-ASCII")) }
+    assert_raises(DText::Error) { parse("café".dup.force_encoding("US-ASCII")) }
+    assert_raises(DText::Error) { DText.parse_incremental("café".dup.force_encoding("US-ASCII")) }
     assert_raises(DText::Error) { parse("\xFF".dup.force_encoding("UTF-8")) }
   end
 
+  def test_input_validation
+    ["\xC0\xAF", "\xE0\x9F\xBF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xE6\x9D", "\xE6\x9Dx", "\x80"].each do |bytes|
+      [bytes, "#{"x" * 20}#{bytes}", "東方#{bytes}#{"x" * 20}"].each do |input|
+        error = assert_raises(DText::Error) { parse(input.dup.force_encoding("UTF-8")) }
+        assert_equal("input contains invalid UTF-8", error.message, input.inspect)
+      end
+    end
+
+    assert_equal("input contains null byte", assert_raises(DText::Error) { parse("#{"x" * 20}\0") }.message)
+    assert_equal("input contains invalid UTF-8", assert_raises(DText::Error) { parse("\0#{"x" * 20}\xFF".dup.force_encoding("UTF-8")) }.message)
+
+    assert_parse("<p>\u{7FF}\u{FFFF}\u{10FFFF}\u{E000}</p>", "\u{7FF}\u{FFFF}\u{10FFFF}\u{E000}")
+    assert_parse("<p>#{"x" * 15}<br>#{"y" * 16}<br> #{"z" * 16}</p>", "#{"x" * 15}\r\n#{"y" * 16}\r\n\r#{"z" * 16}")
+  end
+
   def test_wiki_link_xss
     assert_raises(DText::Error) do
       parse("[[\xFA<script \xFA>alert(42); //\xFA</script \xFA>]]")